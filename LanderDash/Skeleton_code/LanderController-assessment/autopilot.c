@@ -0,0 +1,58 @@
+/* Autopilot
+ * KV5002
+ */
+#include <string.h>
+
+#include "autopilot.h"
+
+/* Vertical: aim to descend at DESCENTRATIO x altitude per second, no
+   faster than MAXDESCENT and no slower than TOUCHDOWN near the ground.
+   y' is taken as negative while descending. */
+#define DESCENTRATIO 0.1
+#define MAXDESCENT 20.0
+#define TOUCHDOWN 1.0
+#define KP_VERTICAL 8.0
+#define KI_VERTICAL 2.0
+
+/* Attitude: lean against sideways drift by up to MAXLEAN radians */
+#define KP_DRIFT 0.05
+#define MAXLEAN 0.3
+#define KP_ATTITUDE 2.0
+#define KD_ATTITUDE 1.0
+
+static float clamp(float v, float lo, float hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+void autopilot_reset(struct autopilot *ap)
+{
+    memset(ap, 0, sizeof(*ap));
+}
+
+struct command autopilot_step(struct autopilot *ap, const struct condition *cond,
+                              const struct state *st, float dt)
+{
+    struct command cmd = {0, 0};
+    float target, error, thrust, lean;
+
+    if (cond->contact != Flying || cond->fuel <= 0)
+    {
+        autopilot_reset(ap);
+        return cmd; /* engine off once down */
+    }
+
+    // Vertical speed, PI
+    target = -clamp(cond->altitude * DESCENTRATIO, TOUCHDOWN, MAXDESCENT);
+    error = target - st->dy; /* positive: falling too fast */
+    thrust = KP_VERTICAL * error + KI_VERTICAL * ap->integral;
+    if (thrust > 0 && thrust < 100) /* don't wind up while saturated */
+        ap->integral += error * dt;
+    cmd.thrust = clamp(thrust, 0, 100);
+
+    // Attitude, PD towards a lean that cancels drift
+    lean = clamp(-st->dx * KP_DRIFT, -MAXLEAN, MAXLEAN);
+    cmd.rotn = clamp(KP_ATTITUDE * (lean - st->O) - KD_ATTITUDE * st->dO, -1, 1);
+
+    return cmd;
+}
@@ -0,0 +1,25 @@
+/* Autopilot
+ * KV5002
+ *
+ * Closed-loop landing: works out main-engine and rcs-roll from each fresh
+ * lander sample.  A PI loop on vertical speed brings the descent rate down
+ * in proportion to altitude, and a PD loop on attitude keeps the lander
+ * upright while leaning gently against any sideways drift.
+ */
+#ifndef _AUTOPILOT_H
+#define _AUTOPILOT_H
+
+#include "lander.h"
+
+struct autopilot
+{
+    float integral; /* vertical speed error, integrated */
+};
+
+void autopilot_reset(struct autopilot *ap);
+
+/* Computes the command for a sample, dt is seconds since the last one */
+struct command autopilot_step(struct autopilot *ap, const struct condition *cond,
+                              const struct state *st, float dt);
+
+#endif
@@ -71,6 +71,16 @@ void drawleds()
     for(n=0 ; n<4 ; n++) drawled(n,0);
 }
 
+void console_single_threaded(void)
+{
+    /* never locks anyway */
+}
+
+void console_refresh(void)
+{
+    /* every call is already on the screen */
+}
+
 int console_init()
 {
     setlocale(LC_ALL, "");
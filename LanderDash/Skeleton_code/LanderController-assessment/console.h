@@ -2,9 +2,28 @@
 #define _CONSOLE_H
 
 /* some constants */
+#ifdef NOCURSES
+/* console_tty.c, the same values as curses so either backend links */
+#define ERR (-1)
+#define KEY_DOWN 0402
+#define KEY_UP 0403
+#define KEY_LEFT 0404
+#define KEY_RIGHT 0405
+#define A_NORMAL 0
+#define A_STANDOUT (1 << 16)
+#define A_UNDERLINE (1 << 17)
+#define A_REVERSE (1 << 18)
+#define A_BLINK (1 << 19)
+#define A_DIM (1 << 20)
+#define A_BOLD (1 << 21)
+extern int LINES, COLS; /* the terminal's size */
+#else
 #include <curses.h>
+#endif
 
 int  console_init(void);  /* initialise LCD return sucess/fail */
+void console_single_threaded(void); /* only one thread uses the console, skip locking */
+void console_refresh(void); /* show what has been written, console_tty.o holds it until then */
 
 /* LCD api */
 void lcd_set_pos(int row, int column);
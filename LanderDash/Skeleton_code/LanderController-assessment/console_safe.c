@@ -16,6 +16,35 @@
 #include "console.h"
 
 static sem_t sem;
+static bool unlocked = false; /* only one thread uses the console */
+
+static void enter(void)
+{
+    int rc;
+    if (unlocked)
+        return;
+    rc = sem_wait(&sem);
+    assert(rc == 0);
+}
+
+static void leave(void)
+{
+    int rc;
+    if (unlocked)
+        return;
+    rc = sem_post(&sem);
+    assert(rc == 0);
+}
+
+void console_single_threaded(void)
+{
+    unlocked = true;
+}
+
+void console_refresh(void)
+{
+    /* every call is already on the screen */
+}
 
 static short setcolor(short fg, short bg)
 {
@@ -114,129 +143,96 @@ int console_init()
 
 void lcd_set_pos(int row, int column)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     wmove(screen, row, column);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 void lcd_set_colour(int foreground, int background)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     wcolor_set(screen, setcolor(foreground, background), NULL);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 void lcd_set_attr(int attributes)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     wattron(screen, attributes);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 void lcd_unset_attr(int attributes)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     wattroff(screen, attributes);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 int lcd_write(const char *fmt, ...)
 {
-    int rc;
     int ret;
     va_list args;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     va_start(args, fmt);
     ret = vw_printw(screen, fmt, args);
     va_end(args);
     wrefresh(lcd);
     wrefresh(screen);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
     return ret;
 }
 
 int lcd_write_at(int row, int col, const char *fmt, ...)
 {
-    int rc;
     int ret;
     va_list args;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     wmove(screen, row, col);
     va_start(args, fmt);
     ret = vw_printw(screen, fmt, args);
     va_end(args);
     wrefresh(lcd);
     wrefresh(screen);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
     return ret;
 }
 
 void led_on(leds_t n)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     drawled(n, TRUE);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 void led_off(leds_t n)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     drawled(n, FALSE);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 void led_toggle(leds_t n)
 {
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     drawled(n, 1 - ledstate[n]);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
 }
 
 int is_pressed(int button)
 {
     int ret;
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     ret = wgetch(screen) == button;
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
     return ret;
 }
 
 int key_pressed(void)
 {
     int ret;
-    int rc;
-    rc = sem_wait(&sem);
-    assert(rc == 0);
+    enter();
     ret = wgetch(screen);
-    rc = sem_post(&sem);
-    assert(rc == 0);
+    leave();
     return ret;
 }
\ No newline at end of file
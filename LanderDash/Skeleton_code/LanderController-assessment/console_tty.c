@@ -0,0 +1,449 @@
+/* Console without curses
+ * KV5002
+ *
+ * The console.h api straight onto an ANSI terminal, for the embedded and
+ * remote builds: the same LED row, box and screen as console_safe.c, but
+ * no terminfo to load and nothing allocated.  Writes go into a frame of
+ * cells; console_refresh() compares it with what the terminal was last
+ * sent and sends only the cells that differ, in one write(), moving the
+ * cursor and changing colour only where it must.  A display that redraws
+ * every field each time costs only the characters that actually changed.
+ * Keys are read raw and the arrow sequences turned into the curses KEY_
+ * values.  The terminal is put back at exit and, as curses does, on
+ * SIGINT and SIGTERM.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+#include <assert.h>
+#include <semaphore.h>
+
+#include "console.h"
+
+#define MAXROWS 128
+#define MAXCOLS 256
+#define OUTSIZE 16384 /* bytes sent in one write, a full redraw may take more */
+#define ATTRSHIFT 16  /* the A_ bits, moved down to fit a cell */
+#define MAXGAP 4      /* unchanged cells worth sending again to save a cursor move */
+
+struct cell
+{
+    char ch; /* '\0' in shown[] for not known */
+    unsigned char fg, bg, attrs;
+};
+
+static sem_t sem;
+static bool unlocked = false; /* only one thread uses the console */
+
+int LINES = 24, COLS = 80; /* the terminal, as curses has them */
+
+static struct termios saved;
+static int row, col;                  /* the screen's cursor */
+static int fg = 7, bg = 0, attrs = 0; /* what the screen writes with */
+static bool ledstate[4] = { 0, 0, 0, 0 };
+
+static struct cell frame[MAXROWS][MAXCOLS]; /* what has been written */
+static struct cell shown[MAXROWS][MAXCOLS]; /* what the terminal has */
+static bool dirty[MAXROWS];
+static struct cell pen;          /* the terminal's colours, ch '\0' if not known */
+static int cursorrow, cursorcol; /* the terminal's cursor, -1 if not known */
+static char out[OUTSIZE];
+static size_t outlen;
+
+static void enter(void)
+{
+    int rc;
+    if (unlocked)
+        return;
+    rc = sem_wait(&sem);
+    assert(rc == 0);
+}
+
+static void leave(void)
+{
+    int rc;
+    if (unlocked)
+        return;
+    rc = sem_post(&sem);
+    assert(rc == 0);
+}
+
+void console_single_threaded(void)
+{
+    unlocked = true;
+}
+
+/* ---- Output ---- */
+
+static void flushout(void)
+{
+    const char *s = out;
+    ssize_t n;
+
+    while (outlen > 0 && (n = write(STDOUT_FILENO, s, outlen)) > 0)
+    {
+        s += n;
+        outlen -= n;
+    }
+    outlen = 0;
+}
+
+static void emit(const char *s, size_t len)
+{
+    if (outlen + len > sizeof(out))
+        flushout();
+    memcpy(out + outlen, s, len);
+    outlen += len;
+}
+
+static bool samepen(const struct cell *a, const struct cell *b)
+{
+    return a->fg == b->fg && a->bg == b->bg && a->attrs == b->attrs;
+}
+
+// Changes the terminal's colours and attributes to the cell's, sending only what differs
+static void setpen(const struct cell *c)
+{
+    char buf[64];
+    int a = c->attrs << ATTRSHIFT, len;
+
+    if (pen.ch && samepen(&pen, c))
+        return;
+    if (!pen.ch || pen.attrs != c->attrs)
+        len = snprintf(buf, sizeof(buf), "\033[0%s%s%s%s%s;38;5;%d;48;5;%dm",
+                       a & A_BOLD ? ";1" : "", a & A_DIM ? ";2" : "",
+                       a & A_UNDERLINE ? ";4" : "", a & A_BLINK ? ";5" : "",
+                       a & (A_REVERSE | A_STANDOUT) ? ";7" : "", c->fg, c->bg);
+    else if (pen.fg != c->fg && pen.bg != c->bg)
+        len = snprintf(buf, sizeof(buf), "\033[38;5;%d;48;5;%dm", c->fg, c->bg);
+    else if (pen.fg != c->fg)
+        len = snprintf(buf, sizeof(buf), "\033[38;5;%dm", c->fg);
+    else
+        len = snprintf(buf, sizeof(buf), "\033[48;5;%dm", c->bg);
+    emit(buf, len);
+    pen = *c;
+    pen.ch = 1;
+}
+
+static void moveto(int r, int c)
+{
+    char buf[16];
+
+    if (r == cursorrow && c == cursorcol)
+        return;
+    emit(buf, snprintf(buf, sizeof(buf), "\033[%d;%dH", r + 1, c + 1));
+    cursorrow = r;
+    cursorcol = c;
+}
+
+static void putcell(int r, int c)
+{
+    setpen(&frame[r][c]);
+    emit(&frame[r][c].ch, 1);
+    shown[r][c] = frame[r][c];
+    cursorcol = c == COLS - 1 ? -1 : c + 1; /* the last column leaves it waiting to wrap */
+}
+
+// True if the cursor can get to column c by sending the cells before it again
+static bool closegap(int r, int c)
+{
+    int k;
+
+    if (r != cursorrow || cursorcol < 0 || cursorcol >= c || c - cursorcol > MAXGAP)
+        return false;
+    for (k = cursorcol; k < c; k++)
+        if (!samepen(&frame[r][k], &pen))
+            return false;
+    return true;
+}
+
+// Sends the cells that differ from what the terminal has
+static void update(void)
+{
+    int r, c, k;
+
+    for (r = 0; r < LINES; r++)
+    {
+        if (!dirty[r])
+            continue;
+        for (c = 0; c < COLS; c++)
+        {
+            if (shown[r][c].ch == frame[r][c].ch && samepen(&shown[r][c], &frame[r][c]))
+                continue;
+            if (closegap(r, c))
+                for (k = cursorcol; k < c; k++)
+                    putcell(r, k);
+            moveto(r, c);
+            putcell(r, c);
+        }
+        dirty[r] = false;
+    }
+    flushout();
+}
+
+/* ---- Drawing into the frame ---- */
+
+static void setcell(int r, int c, char ch, int f, int b, int a)
+{
+    if (r < 0 || r >= LINES || c < 0 || c >= COLS)
+        return;
+    frame[r][c].ch = ch;
+    frame[r][c].fg = f;
+    frame[r][c].bg = b;
+    frame[r][c].attrs = a >> ATTRSHIFT;
+    dirty[r] = true;
+}
+
+static void drawled(int n, bool s)
+{
+    static const int colour[4] = { 7, 9, 10, 12 };
+
+    setcell(0, 8 + n * 6, s ? ' ' : '#', colour[n], 8, s ? A_REVERSE : A_DIM);
+    ledstate[n] = s;
+}
+
+// The LED row and the box round the screen
+static void drawframe(void)
+{
+    static const char title[] = " Led   0     1     2     3       ";
+    int r, c;
+
+    for (r = 0; r < LINES; r++)
+        for (c = 0; c < COLS; c++)
+            setcell(r, c, ' ', 7, r == 0 ? 8 : 0, 0);
+    for (c = 0; c < sizeof(title) - 1; c++)
+        setcell(0, c, title[c], 7, 8, 0);
+
+    for (c = 0; c < COLS; c++)
+    {
+        setcell(1, c, c == 0 || c == COLS - 1 ? '+' : '-', 7, 8, 0);
+        setcell(LINES - 1, c, c == 0 || c == COLS - 1 ? '+' : '-', 7, 8, 0);
+    }
+    for (c = 0; c < 3; c++)
+        setcell(1, c + 1, "lcd"[c], 7, 8, 0);
+    for (r = 2; r < LINES - 1; r++)
+    {
+        setcell(r, 0, '|', 7, 8, 0);
+        setcell(r, COLS - 1, '|', 7, 8, 0);
+    }
+
+    for (c = 0; c < 4; c++)
+        drawled(c, 0);
+}
+
+static const char reset[] = "\033[0m\033[?25h\033[2J\033[H";
+
+static void lcdshutdown(void)
+{
+    emit(reset, sizeof(reset) - 1);
+    flushout();
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+}
+
+// Puts the terminal back with async-signal-safe calls only, then the signal kills us as it would have
+static void lcdsignal(int sig)
+{
+    if (write(STDOUT_FILENO, reset, sizeof(reset) - 1) < 0)
+        ; /* nothing more can be done about it here */
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    raise(sig); /* SA_RESETHAND has made it the default again, it lands on return */
+}
+
+// Catches sig for lcdsignal(), unless the program already handles it
+static void catch(int sig)
+{
+    struct sigaction sa = {.sa_handler = lcdsignal, .sa_flags = SA_RESETHAND};
+    struct sigaction old;
+
+    if (sigaction(sig, NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+        sigaction(sig, &sa, NULL);
+}
+
+int console_init()
+{
+    static const char clear[] = "\033[0m\033[?25l\033[2J";
+    struct termios raw;
+    struct winsize ws;
+    int rc;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4 && ws.ws_col > 4)
+    {
+        LINES = ws.ws_row < MAXROWS ? ws.ws_row : MAXROWS;
+        COLS = ws.ws_col < MAXCOLS ? ws.ws_col : MAXCOLS;
+    }
+    if (tcgetattr(STDIN_FILENO, &saved) == 0)
+    {
+        raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        atexit(lcdshutdown);
+        catch(SIGINT);
+        catch(SIGTERM);
+    }
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+
+    emit(clear, sizeof(clear) - 1);
+    cursorrow = cursorcol = -1;
+    drawframe();
+    update();
+    rc = sem_init(&sem, 0, 1);
+    assert(rc == 0);
+    return 1;
+}
+
+void console_refresh(void)
+{
+    enter();
+    update();
+    leave();
+}
+
+void lcd_set_pos(int r, int c)
+{
+    enter();
+    row = r;
+    col = c;
+    leave();
+}
+
+void lcd_set_colour(int foreground, int background)
+{
+    enter();
+    fg = foreground;
+    bg = background;
+    leave();
+}
+
+void lcd_set_attr(int attributes)
+{
+    enter();
+    attrs |= attributes;
+    leave();
+}
+
+void lcd_unset_attr(int attributes)
+{
+    enter();
+    attrs &= ~attributes;
+    leave();
+}
+
+// Writes at the cursor inside the box, clipped to it, a newline clearing the rest of the line
+static int vwrite(const char *fmt, va_list args)
+{
+    char text[2 * MAXCOLS];
+    int width = COLS - 2, height = LINES - 3;
+    int n, i;
+
+    n = vsnprintf(text, sizeof(text), fmt, args);
+    if (n < 0)
+        return ERR;
+    if (n >= sizeof(text))
+        n = sizeof(text) - 1;
+
+    for (i = 0; i < n && row < height; i++)
+    {
+        if (text[i] == '\n')
+        {
+            for (; col < width; col++)
+                setcell(row + 2, col + 1, ' ', fg, bg, attrs);
+            row++;
+            col = 0;
+        }
+        else if (col < width)
+            setcell(row + 2, 1 + col++, text[i], fg, bg, attrs);
+    }
+    return 0;
+}
+
+int lcd_write(const char *fmt, ...)
+{
+    int ret;
+    va_list args;
+    enter();
+    va_start(args, fmt);
+    ret = vwrite(fmt, args);
+    va_end(args);
+    leave();
+    return ret;
+}
+
+int lcd_write_at(int r, int c, const char *fmt, ...)
+{
+    int ret;
+    va_list args;
+    enter();
+    row = r;
+    col = c;
+    va_start(args, fmt);
+    ret = vwrite(fmt, args);
+    va_end(args);
+    leave();
+    return ret;
+}
+
+void led_on(leds_t n)
+{
+    enter();
+    drawled(n, true);
+    leave();
+}
+
+void led_off(leds_t n)
+{
+    enter();
+    drawled(n, false);
+    leave();
+}
+
+void led_toggle(leds_t n)
+{
+    enter();
+    drawled(n, !ledstate[n]);
+    leave();
+}
+
+// The next key, the arrows' ESC [ A..D and ESC O A..D as KEY_UP.., or ERR
+static int getkey(void)
+{
+    static const int arrows[4] = { KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT };
+    unsigned char k[3];
+
+    if (read(STDIN_FILENO, k, 1) != 1)
+        return ERR;
+    if (k[0] != '\033')
+        return k[0];
+    if (read(STDIN_FILENO, k + 1, 2) == 2 && (k[1] == '[' || k[1] == 'O') &&
+        k[2] >= 'A' && k[2] <= 'D')
+        return arrows[k[2] - 'A'];
+    return k[0];
+}
+
+int is_pressed(int button)
+{
+    int ret;
+    enter();
+    ret = getkey() == button;
+    leave();
+    return ret;
+}
+
+int key_pressed(void)
+{
+    int ret;
+    enter();
+    ret = getkey();
+    leave();
+    return ret;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <signal.h>
 
@@ -11,494 +12,1581 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "libnet.h"
 #include "console.h"
+#include "pubsub.h"
+#include "lander.h"
+#include "fleet.h"
+#include "livestate.h"
+#include "rt.h"
+#include "autopilot.h"
+#include "estimator.h"
+#include "predict.h"
+#include "history.h"
+#include "executor.h"
+#include "flightlog.h"
+#include "proxy.h"
+#include "version.h"
 
 #include <ctype.h>
-#include <curses.h>
 #include <time.h>
 
 /* -------------------- Semaphores and Global Variables --------------------
 
     Used for communication between the threads
 */
-struct command
-{
-    float thrust;
-    float rotn;
-} landercommand;
+struct command landercommand;
 sem_t cmdlock;
 
-struct state
-{
-    float x, y, O;
-    float dx, dy, dO;
-} landerstate;
+struct state landerstate;
+struct rxstamp landersampled; /* when landerstate arrived, by the kernel's clock */
 sem_t statelock;
 
-enum condstate
+struct condition landercond;
+sem_t condlock;
+
+/* Moved on by every new sample, and by every change the pilot or the
+   autopilot makes, so the display and dashboards can wait for news */
+struct version sampleversion, commandversion;
+
+struct livestate *live; /* live state file for monitors, NULL if not wanted */
+
+struct connection landerlink; /* lander link, with its loss/retry counters */
+long replytimeout = 40;       /* ms to wait for each reply */
+int retries = 2;              /* times to resend a request before giving up */
+float minrate = 1, maxrate = 20; /* bounds on the lander poll rate, Hz */
+float landerrate;                /* the rate chosen for the flight phase */
+
+/* Estimated state between lander polls, for the display, dashboard and log */
+struct estimator estimate;
+
+/* Recent samples, for trends and alerts */
+struct history history;
+#define TRENDWINDOW 10.0  /* seconds of history the display summarises */
+#define FASTDESCENT 10.0  /* alert if coming down faster than this... */
+#define ALERTTIME 15.0    /* ...with touchdown less than this many seconds away */
+
+/* In event loop mode (-e) one thread does everything and there is
+   nothing to lock */
+int eventloop;
+
+void lock(sem_t *s)
 {
-    Flying,
-    Down,
-    Crashed
-};
-struct condition
+    if (!eventloop)
+        sem_wait(s);
+}
+
+void unlock(sem_t *s)
 {
-    float fuel;
-    float altitude;
-    int contact;
-} landercond;
-sem_t condlock;
+    if (!eventloop)
+        sem_post(s);
+}
+
+// The best guess at the state and condition right now
+void currentstate(struct state *st, struct condition *cond)
+{
+    struct timespec now;
+
+    lock(&condlock);
+    *cond = landercond;
+    unlock(&condlock);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    estimator_predict(&estimate, &now, st, &cond->altitude);
+}
+
+/* Autopilot hand-off: the lander posts each fresh sample, the autopilot
+   posts back once it has put its command in landercommand */
+int autopilotengaged;
+sem_t samplesem, commandsem;
+#define AUTOPILOTWAIT 5000000L /* ns the lander waits for the autopilot */
+int planrollouts;    /* if not 0, the autopilot picks the best of this many plans */
+float planscore;     /* score of the plan it picked */
+
+/* Command uplink: a command goes to the lander only if it differs from
+   the last one the lander acknowledged (or that is COMMANDREFRESH old),
+   and a change at the keyboard wakes the lander task to send it at once
+   rather than at the end of its next poll */
+#define COMMANDREFRESH 1000000000L /* ns, resend an unchanged command this often */
+struct command lastacked;
+struct timespec lastack;          /* when, zero if never */
+unsigned long uplinks, unchanged; /* commands sent between polls, sends skipped */
+struct task *uplinktask;          /* the lander task */
+
+// True if the two commands match in every field of the schema
+int samecommand(const struct command *a, const struct command *b)
+{
+#define SAMEFIELD(NAME, member, key, wire, type) && a->member == b->member
+    return true COMMAND_FIELDS(SAMEFIELD);
+}
+
+int commandchanged(const struct command *cmd)
+{
+    struct timespec now;
+
+    if (lastack.tv_sec == 0 && lastack.tv_nsec == 0)
+        return true;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((int64_t)(now.tv_sec - lastack.tv_sec) * 1000000000L + (now.tv_nsec - lastack.tv_nsec) >= COMMANDREFRESH)
+        return true;
+    return !samecommand(cmd, &lastacked);
+}
+
+void commandacked(const struct command *cmd)
+{
+    lastacked = *cmd;
+    clock_gettime(CLOCK_MONOTONIC, &lastack);
+}
+
+int proxysock = -1; /* the lander query proxy's, -1 if not wanted */
+
+/* Fixed-rate periods of the periodic tasks, with their missed deadlines */
+struct period keyboardperiod, displayperiod, landerperiod, dashboardperiod, loggingperiod;
 
 /* -------------------- Keyboard Input --------------------
 
-    Runs in own thread, interprets user input
+    Interprets user input, every key pressed since the last step
     Generates command structures for transmission to lander
 */
+#define KEYPERIOD 20000000L /* ns between looks at the keyboard */
 int last;
-void *keyboard(void *data)
+void presskey(int key)
 {
-    landercommand.thrust = 0;
-    landercommand.rotn = 0;
-    while (true)
+    struct command before;
+    bool engaged = autopilotengaged;
+    bool changed;
+
+    last = key;
+
+    /* 'a' toggles the autopilot, any arrow key takes over from it */
+    if (key == 'a')
+    {
+        autopilotengaged = !autopilotengaged;
+        version_bump(&commandversion);
+        return;
+    }
+    if (key == KEY_UP || key == KEY_DOWN || key == KEY_LEFT || key == KEY_RIGHT)
+        autopilotengaged = false;
+
+    lock(&cmdlock); /*Enter critical section*/
+    before = landercommand;
+    switch (key)
+    {
+    case KEY_UP:
+        landercommand.thrust += 2;
+        if (landercommand.thrust > 100)
+            landercommand.thrust = 100;
+        break;
+    case KEY_DOWN:
+        landercommand.thrust -= 2;
+        if (landercommand.thrust < 0)
+            landercommand.thrust = 0;
+        break;
+    case KEY_RIGHT:
+        landercommand.rotn += 0.1;
+        if (landercommand.rotn >= 1)
+            landercommand.rotn = 1;
+        break;
+    case KEY_LEFT:
+        landercommand.rotn -= 0.1;
+        if (landercommand.rotn <= -1.0)
+            landercommand.rotn = -1;
+        break;
+    }
+    changed = !samecommand(&landercommand, &before);
+    unlock(&cmdlock); /*Exit critical section*/
+
+    /* only once the new command is there to be read */
+    if (changed || autopilotengaged != engaged)
+        version_bump(&commandversion);
+}
+
+// Sends a changed command straight away
+void commanduplink(const struct command *before)
+{
+    if (uplinktask && !samecommand(&landercommand, before))
+        task_wake(uplinktask);
+}
+
+int64_t keyboard(void *data)
+{
+    struct command before = landercommand;
+    int key;
+
+    /* every key waiting, so a burst of auto-repeat is one change */
+    while ((key = key_pressed()) != ERR)
+        presskey(key);
+
+    commanduplink(&before);
+    return KEYPERIOD;
+}
+
+/* -------------------- Headless Commands --------------------
+
+    With -H there is no screen and no keyboard; the commands come a line
+    at a time from a script file, or in datagrams (a line or more each)
+    on a unix socket:
+
+        up, down, left, right   as the arrow keys
+        autopilot               as 'a', toggles it
+        thrust n, rotn n        set outright, taking over from the autopilot
+        wait s                  scripts only, carry on after s seconds
+
+    Blank lines and lines starting with # are skipped.
+*/
+int headless;
+FILE *commandscript; /* -H file */
+int commandsock = -1; /* -H unix:path */
+
+// Opens the script or binds the socket, returns false on failure
+int commandsopen(char *source)
+{
+    if (strncmp(source, "unix:", 5) == 0)
+        return (commandsock = mkunixsocket(source + 5)) != 0;
+    if ((commandscript = fopen(source, "r")) == NULL)
     {
+        fprintf(stderr, "Cannot open command script %s: %s\n", source, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Carries out one command line, returns false if it isn't one
+int commandline(const char *line)
+{
+    static const struct
+    {
+        const char *name;
         int key;
-        while ((key = key_pressed()) == ERR)
+    } keys[] = {{"up", KEY_UP}, {"down", KEY_DOWN}, {"left", KEY_LEFT},
+                {"right", KEY_RIGHT}, {"autopilot", 'a'}};
+    char word[16];
+    float value;
+    int i, n = sscanf(line, " %15s %f", word, &value);
+
+    if (n < 1 || word[0] == '#')
+        return true;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        if (strcmp(word, keys[i].name) == 0)
         {
-            ;
-        } /* wait for a key-press */
+            presskey(keys[i].key);
+            return true;
+        }
+    if (n < 2 || (strcmp(word, "thrust") != 0 && strcmp(word, "rotn") != 0))
+        return false;
+
+    autopilotengaged = false;
+    lock(&cmdlock);
+    if (word[0] == 't')
+        landercommand.thrust = value < 0 ? 0 : value > 100 ? 100 : value;
+    else
+        landercommand.rotn = value < -1 ? -1 : value > 1 ? 1 : value;
+    unlock(&cmdlock);
+    version_bump(&commandversion);
+    return true;
+}
+
+// Every line of a datagram, then any change goes straight up
+void commandmessage(char *msg)
+{
+    struct command before = landercommand;
+    char *line, *rest;
+
+    for (line = strtok_r(msg, "\n", &rest); line; line = strtok_r(NULL, "\n", &rest))
+        if (!commandline(line))
+            fprintf(stderr, "Unknown command: %s\n", line);
+    commanduplink(&before);
+}
+
+// The script as a task: runs lines up to the next wait and sleeps exactly that long
+int64_t script(void *data)
+{
+    struct command before = landercommand;
+    char line[128];
+    double secs;
 
-        last = key;
-        sem_wait(&cmdlock); /*Enter critical section*/
-        switch (key)
+    while (fgets(line, sizeof(line), commandscript))
+    {
+        if (sscanf(line, " wait %lf", &secs) == 1)
         {
-        case KEY_UP:
-            landercommand.thrust += 2;
-            if (landercommand.thrust > 100)
-                landercommand.thrust = 100;
-            break;
-        case KEY_DOWN:
-            landercommand.thrust -= 2;
-            if (landercommand.thrust < 0)
-                landercommand.thrust = 0;
-            break;
-        case KEY_RIGHT:
-            landercommand.rotn += 0.1;
-            if (landercommand.rotn >= 1)
-                landercommand.rotn = 1;
-            break;
-        case KEY_LEFT:
-            landercommand.rotn -= 0.1;
-            if (landercommand.rotn <= -1.0)
-                landercommand.rotn = -1;
-            break;
+            if (secs <= 0)
+                continue;
+            commanduplink(&before);
+            return secs * 1e9;
         }
-        sem_post(&cmdlock); /*Exit critical section*/
+        if (!commandline(line))
+            fprintf(stderr, "Unknown command: %s", line);
+    }
+    commanduplink(&before);
+    fclose(commandscript);
+    commandscript = NULL;
+    return -1; /* the last command stays */
+}
+
+// Takes whatever datagrams are waiting, for the event loop
+void commandsready(void)
+{
+    char msg[512];
+    ssize_t n;
+
+    while ((n = recv(commandsock, msg, sizeof(msg) - 1, MSG_DONTWAIT)) >= 0)
+    {
+        msg[n] = '\0';
+        commandmessage(msg);
     }
 }
 
+// Thread function, blocks for each datagram
+void *commands(void *data)
+{
+    char msg[512];
+    ssize_t n;
+
+    while ((n = recv(commandsock, msg, sizeof(msg) - 1, 0)) >= 0 || errno == EINTR)
+    {
+        if (n < 0)
+            continue;
+        msg[n] = '\0';
+        commandmessage(msg);
+    }
+    fprintf(stderr, "Command socket failed: %s\n", strerror(errno));
+    return NULL;
+}
+
 /* -------------------- Display Management --------------------
 
     Updates the display with lander diagnostic information
 */
-void *display(void *data)
+// What busy polling the lander link costs and what it buys, on two rows
+void busypollreport(int row)
 {
-    while (true)
+    const struct busypoll *b = &landerlink.busy;
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - b->since.tv_sec) * 1e9 + (now.tv_nsec - b->since.tv_nsec);
+    lcd_write_at(row, 0, "busy poll %4ld/%ld us  caught spinning %-6lu blocked %-6lu cpu %5.1f%%",
+                 b->limit / 1000, b->budget / 1000, b->hits, b->blocks,
+                 100.0 * b->spinns / elapsed);
+    lcd_write_at(row + 1, 0, "receive to wake-up  spinning %7.1f us  blocked %7.1f us",
+                 b->hitstamps ? b->hitns / 1e3 / b->hitstamps : 0.0,
+                 b->blockstamps ? b->blockns / 1e3 / b->blockstamps : 0.0);
+}
+
+// Peak resident memory, and the stack each thread has used where it is measured
+void memoryreport(int row)
+{
+    struct stackuse s[MAXSTACKS];
+    char line[128];
+    int n, i, len;
+
+    n = rt_stackuse(s, MAXSTACKS);
+    len = snprintf(line, sizeof(line), "peak rss %ld kB  stack kB used of %d:",
+                   rt_peakrss(), THREADSTACK / 1024);
+    for (i = 0; i < n && len < sizeof(line); i++)
+        if (s[i].size)
+            len += snprintf(line + len, sizeof(line) - len, " %s %zu",
+                            s[i].name, (s[i].used + 1023) / 1024);
+    if (THREADSTACK == 0)
+        snprintf(line, sizeof(line), "peak rss %ld kB  stacks not measured", rt_peakrss());
+    lcd_write_at(row, 0, "%-100.100s", line);
+}
+
+/* The display redraws for a new sample or command (it follows
+   sampleversion, so a sample wakes it), otherwise only every
+   DISPLAYREFRESH to keep the counters moving when the lander is quiet.
+   Samples closer together than DISPLAYSPACING are drawn as one, so it
+   redraws at most 10 times a second however fast the lander is polled */
+#define DISPLAYPERIOD 500000000L
+#define DISPLAYSPACING 100000000L
+#define DISPLAYREFRESH 2000000000L
+uint32_t shownsample, showncommand;
+struct timespec shown;
+unsigned long redraws, unredrawn;
+unsigned long dashboardupdates; /* sent by the dashboard task */
+
+int64_t display(void *data)
+{
+    struct state st;
+    struct condition cond;
+    struct trend alt, fuel;
+    uint32_t sample = version_read(&sampleversion), command = version_read(&commandversion);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (sample == shownsample && command == showncommand &&
+        (int64_t)(now.tv_sec - shown.tv_sec) * 1000000000L + (now.tv_nsec - shown.tv_nsec) < DISPLAYREFRESH)
+    {
+        unredrawn++;
+        return DISPLAYPERIOD;
+    }
+    shownsample = sample;
+    showncommand = command;
+    shown = now;
+    redraws++;
+
+    currentstate(&st, &cond);
+    switch (cond.contact)
+    {
+    case Flying:
+        lcd_set_colour(3, 0);
+        lcd_write_at(1, 30, "Flying ");
+        break;
+    case Down:
+        lcd_set_colour(2, .0);
+        lcd_write_at(1, 30, "Down   ");
+        break;
+    case Crashed:
+        lcd_set_colour(1, 0);
+        lcd_write_at(1, 30, "Crashed");
+        break;
+    }
+    lcd_set_colour(7, 0);
+    lcd_write_at(0, 0, "fuel %f", cond.fuel);
+    lcd_write_at(1, 0, "alt  %f", cond.altitude);
+
+    lcd_write_at(3, 0, "x %-6.1f  x' %-8.6f", st.x, st.dx);
+    lcd_write_at(4, 0, "y %-6.1f  y' %-8.6f", st.y, st.dy);
+    lcd_write_at(5, 0, "O %-6.3f  O' %-8.6f", st.O, st.dO);
+
+    lock(&cmdlock);
+    lcd_write_at(3, 30, "thrust %6.1f", landercommand.thrust);
+    lcd_write_at(4, 30, "rotn %6.1f", landercommand.rotn);
+    unlock(&cmdlock);
+    lcd_write_at(5, 30, "autopilot %s", autopilotengaged ? "on " : "off");
+    if (planrollouts)
+        lcd_write_at(6, 30, "planner %d %s plans, best %-8.1f",
+                     planrollouts, predict_kernel(), planscore);
+
+    lcd_write_at(7, 0, "requests %-8lu retries %-6lu lost %-6lu stale %-6lu reply %5.0f us",
+                 landerlink.stats.requests, landerlink.stats.retries,
+                 landerlink.stats.timeouts, landerlink.stats.stale,
+                 landerlink.stats.replies ? landerlink.stats.replyns / 1e3 / landerlink.stats.replies : 0.0);
+    lcd_write_at(8, 0, "poll rate %4.1f Hz  worst wake-up %ld us   ",
+                 landerrate, landerperiod.maxlatency / 1000);
+    lcd_write_at(9, 0, "missed deadlines  lander %lu  dashboard %lu  display %lu  log %lu",
+                 landerperiod.missed, dashboardperiod.missed,
+                 displayperiod.missed, loggingperiod.missed);
+    lcd_write_at(12, 0, "commands sent on change %-6lu  unchanged, not sent %-6lu",
+                 uplinks, unchanged);
+    if (proxysock != -1)
+    {
+        struct proxystats ps;
+        proxy_stats(&ps);
+        lcd_write_at(13, 0, "proxy queries served %-8lu  too old %-6lu  unknown %-6lu",
+                     ps.served, ps.stale, ps.unknown);
+    }
+    if (landerlink.busy.on)
+        busypollreport(14);
+    memoryreport(16);
+    lcd_write_at(17, 0, "redraws %-6lu  nothing new, not redrawn %-6lu  dashboard updates %-8lu",
+                 redraws, unredrawn, dashboardupdates);
+
+    /* trends over the last few seconds, and what they lead to */
+    if (history_trend(&history, H_ALTITUDE, TRENDWINDOW, &alt) > 1 &&
+        history_trend(&history, H_FUEL, TRENDWINDOW, &fuel) > 1)
+    {
+        float touchdown = alt.rate < 0 ? cond.altitude / -alt.rate : -1;
+        float empty = fuel.rate < 0 ? cond.fuel / -fuel.rate : -1;
+
+        lcd_write_at(10, 0, "last %2.0fs  descent %6.2f  alt %.1f..%-.1f  fuel %6.3f %%/s   ",
+                     alt.span, -alt.rate, alt.min, alt.max, -fuel.rate);
+        if (cond.contact != Flying)
+            lcd_write_at(11, 0, "%-60s", "");
+        else if (empty >= 0 && touchdown >= 0 && empty < touchdown)
+            lcd_write_at(11, 0, "ALERT fuel runs out in %.0fs, touchdown in %.0fs          ",
+                         empty, touchdown);
+        else if (-alt.rate > FASTDESCENT && touchdown >= 0 && touchdown < ALERTTIME)
+            lcd_write_at(11, 0, "ALERT descending at %.1f, touchdown in %.0fs               ",
+                         -alt.rate, touchdown);
+        else
+            lcd_write_at(11, 0, "%-60s", "");
+    }
+
+    switch (last)
     {
-        sem_wait(&condlock);
-        switch (landercond.contact)
+    case KEY_UP:
+        lcd_write_at(0, 40, "up   ");
+        break;
+    case KEY_DOWN:
+        lcd_write_at(0, 40, "down ");
+        break;
+    case KEY_LEFT:
+        lcd_write_at(0, 40, "left ");
+        break;
+    case KEY_RIGHT:
+        lcd_write_at(0, 40, "right");
+        break;
+    default:
+        lcd_write_at(0, 40, "%c   ", last);
+    }
+
+    console_refresh();
+    return DISPLAYPERIOD;
+}
+
+/* -------------------- Fleet Display --------------------
+
+    Summary of every lander in fleet mode, one line each for as many
+    landers as fit on the screen
+*/
+int64_t fleetdisplay(void *data)
+{
+    const char *contact[] = {"Flying ", "Down   ", "Crashed"};
+    int flying = 0, down = 0, crashed = 0;
+    unsigned long timeouts = 0, stale = 0;
+    int rows = LINES - 6;
+    int i;
+
+    sem_wait(&fleetlock);
+    for (i = 0; i < fleetsize; i++)
+    {
+        switch (fleet[i].cond.contact)
         {
         case Flying:
-            lcd_set_colour(3, 0);
-            lcd_write_at(1, 30, "Flying ");
+            flying++;
             break;
         case Down:
-            lcd_set_colour(2, .0);
-            lcd_write_at(1, 30, "Down   ");
+            down++;
             break;
         case Crashed:
-            lcd_set_colour(1, 0);
-            lcd_write_at(1, 30, "Crashed");
-            break;
-        }
-        lcd_set_colour(7, 0);
-        lcd_write_at(0, 0, "fuel %f", landercond.fuel);
-        lcd_write_at(1, 0, "alt  %f", landercond.altitude);
-        sem_post(&condlock);
-
-        sem_wait(&statelock);
-        lcd_write_at(3, 0, "x %-6.1f  x' %-8.6f", landerstate.x, landerstate.dx);
-        lcd_write_at(4, 0, "y %-6.1f  y' %-8.6f", landerstate.y, landerstate.dy);
-        lcd_write_at(5, 0, "O %-6.3f  O' %-8.6f", landerstate.O, landerstate.dO);
-        sem_post(&statelock);
-
-        sem_wait(&cmdlock);
-        lcd_write_at(3, 30, "thrust %6.1f", landercommand.thrust);
-        lcd_write_at(4, 30, "rotn %6.1f", landercommand.rotn);
-        sem_post(&cmdlock);
-
-        switch (last)
-        {
-        case KEY_UP:
-            lcd_write_at(0, 40, "up   ");
+            crashed++;
             break;
-        case KEY_DOWN:
-            lcd_write_at(0, 40, "down ");
-            break;
-        case KEY_LEFT:
-            lcd_write_at(0, 40, "left ");
-            break;
-        case KEY_RIGHT:
-            lcd_write_at(0, 40, "right");
-            break;
-        default:
-            lcd_write_at(0, 40, "%c   ", last);
         }
+        timeouts += fleet[i].timeouts;
+        stale += fleet[i].stale;
 
-        usleep(500000);
+        if (i < rows)
+            lcd_write_at(2 + i, 0, "%-24s alt %8.1f  fuel %5.1f%%  %s",
+                         fleet[i].name, fleet[i].cond.altitude,
+                         fleet[i].cond.fuel, contact[fleet[i].cond.contact]);
     }
+    sem_post(&fleetlock);
+
+    lcd_write_at(0, 0, "landers %d  flying %d  down %d  crashed %d  timeouts %lu  stale %lu   ",
+                 fleetsize, flying, down, crashed, timeouts, stale);
+    lcd_write_at(0, 84, "thrust %6.1f  rotn %6.1f",
+                 landercommand.thrust, landercommand.rotn);
+
+    console_refresh();
+    return 500000000L;
 }
 
-// --- Parse condition reply message --
-void parsecondition(char *m)
+/* -------------------- Lander communication --------------------
+
+    Communicates with the lander model
+    Sends commands and queries state
+    Parses and decodes messages
+*/
+// Opens the link to the lander, address is a port or [transport:]host:port
+int landeropen(char *address)
 {
-    char *line;
-    char *rest;
-    for (/* split into lines lecture 07-2 slide 21 */
-         line = strtok_r(m, "\r\n", &rest);
-         line != NULL;
-         line = strtok_r(NULL, "\r\n", &rest))
+    if (!netconnect(&landerlink, address, "127.0.1.1"))
     {
-        char *key, *value;
-        key = strtok(line, ":");
-        value = strtok(NULL, ":");
+        fprintf(stderr, "Can't get lander address\n");
+        return false;
+    }
+    landerrate = maxrate;
+    return true;
+}
 
-        sem_wait(&condlock); /* Enter critical section */
+// One poll cycle: condition, state and command; returns ns to the next
+int64_t lander(void *data)
+{
+    size_t msgsize = 1000;
+    char msgbuf[msgsize];
+    char ack[100];
+    struct connection *l = &landerlink;
+    struct command cmd;
+    int m;
+
+    /* poll for condition */
+    m = netrequest(l, conditionq, strlen(conditionq), msgbuf, msgsize - 1,
+                   replytimeout, retries);
+    if (m >= 0)
+    {
+        proxy_update(PROXY_CONDITION, msgbuf, m);
+        msgbuf[m] = '\0';
+        parsecondition(msgbuf, &landercond, &condlock);
+    }
 
-        if (strcmp(key, "fuel") == 0)
-            sscanf(value, "%f%%", &(landercond.fuel));
+    /* poll for state */
+    m = netrequest(l, stateq, strlen(stateq), msgbuf, msgsize - 1,
+                   replytimeout, retries);
+    if (m >= 0)
+    {
+        /* the sample is as of when it arrived, not when this thread woke */
+        struct timespec now = l->rx.mono;
+        proxy_update(PROXY_STATE, msgbuf, m);
+        msgbuf[m] = '\0';
+        parsestate(msgbuf, &landerstate, &statelock);
+        lock(&statelock);
+        landersampled = l->rx;
+        unlock(&statelock);
+        estimator_update(&estimate, &landerstate, &landercond, &now);
+        history_add(&history, &now, &landercommand, &landerstate, &landercond);
+        version_bump(&sampleversion);
+
+        /* give the autopilot the fresh sample and wait (briefly) for
+           its command, so it goes out in this same cycle */
+        if (autopilotengaged)
+        {
+            struct timespec deadline;
+            while (sem_trywait(&commandsem) == 0)
+                ; /* a late answer to an earlier sample */
+            sem_post(&samplesem);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += AUTOPILOTWAIT;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_nsec -= 1000000000L;
+                deadline.tv_sec++;
+            }
+            sem_timedwait(&commandsem, &deadline);
+        }
+    }
 
-        if (strcmp(key, "altitude") == 0)
-            sscanf(value, "%f", &(landercond.altitude));
+    /* send the command if it has changed, the reply is its acknowledgement */
+    lock(&cmdlock);
+    cmd = landercommand;
+    unlock(&cmdlock);
+    if (commandchanged(&cmd))
+    {
+        formatcommand(msgbuf, msgsize, &cmd);
+        if (netrequest(l, msgbuf, strlen(msgbuf), ack, sizeof(ack) - 1,
+                       replytimeout, retries) >= 0)
+            commandacked(&cmd);
+    }
+    else
+        unchanged++;
 
-        if (strcmp(key, "contact") == 0)
-        {
-            if (strcmp(value, "flying") == 0)
-                landercond.contact = Flying;
+    /* publish the cycle's snapshot for monitors */
+    if (live)
+        livestate_publish(live, &cmd, &landerstate, &landercond);
 
-            if (strcmp(value, "down") == 0)
-                landercond.contact = Down;
+    /* poll faster the closer the lander is to touching down */
+    landerrate = pollrate(&landercond, &landerstate, minrate, maxrate);
+    return 1000000000L / landerrate;
+}
 
-            if (strcmp(value, "crashed") == 0)
-                landercond.contact = Crashed;
-        }
-        sem_post(&condlock); /* Exit critical section */
-    }
+// The lander task's wake function: sends a changed command between polls
+void uplink(void *data)
+{
+    char msgbuf[200], ack[100];
+    struct command cmd;
+
+    lock(&cmdlock);
+    cmd = landercommand;
+    unlock(&cmdlock);
+    if (!commandchanged(&cmd))
+        return;
+
+    uplinks++;
+    formatcommand(msgbuf, sizeof(msgbuf), &cmd);
+    if (netrequest(&landerlink, msgbuf, strlen(msgbuf), ack, sizeof(ack) - 1,
+                   replytimeout, retries) >= 0)
+        commandacked(&cmd);
 }
 
-// --- Parse state message ---
-void parsestate(char *m)
+/* -------------------- Autopilot --------------------
+
+    Runs in own thread, woken by the lander thread with every fresh
+    sample; computes the command and hands it straight back
+*/
+struct autopilot ap;
+struct timespec aptime; /* when the autopilot last ran */
+struct plans plans;
+unsigned planseed;
+
+void autopilotinit(void)
 {
-    char *line;
-    char *rest;
-    for (/* split into lines lecture 07-2 slide 21 */
-         line = strtok_r(m, "\r\n", &rest);
-         line != NULL; line = strtok_r(NULL, "\r\n", &rest))
+    if (planrollouts && !plans_alloc(&plans, planrollouts))
     {
-        char *key, *value;
-        key = strtok(line, ":");
-        value = strtok(NULL, ":");
-
-        sem_wait(&statelock); /*Enter critical section */
+        fprintf(stderr, "Cannot allocate %d plans\n", planrollouts);
+        planrollouts = 0;
+    }
+    planseed = time(NULL);
+    autopilot_reset(&ap);
+    clock_gettime(CLOCK_MONOTONIC, &aptime);
+}
 
-        if (strcmp(key, "x") == 0)
-            sscanf(value, "%f", &(landerstate.x));
+// Computes the command for the latest sample and puts it in landercommand
+void autopilotcycle(void)
+{
+    struct timespec now;
+    struct condition cond;
+    struct state st;
+    struct command cmd;
+    float dt;
 
-        if (strcmp(key, "y") == 0)
-            sscanf(value, "%f", &(landerstate.y));
+    if (!autopilotengaged)
+    {
+        autopilot_reset(&ap);
+        return;
+    }
 
-        if (strcmp(key, "O") == 0)
-            sscanf(value, "%f", &(landerstate.O));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = (now.tv_sec - aptime.tv_sec) + (now.tv_nsec - aptime.tv_nsec) * 1e-9;
+    aptime = now;
 
-        if (strcmp(key, "x'") == 0)
-            sscanf(value, "%f", &(landerstate.dx));
+    lock(&condlock);
+    cond = landercond;
+    unlock(&condlock);
+    lock(&statelock);
+    st = landerstate;
+    unlock(&statelock);
 
-        if (strcmp(key, "y'") == 0)
-            sscanf(value, "%f", &(landerstate.dy));
+    cmd = autopilot_step(&ap, &cond, &st, dt);
 
-        if (strcmp(key, "O'") == 0)
-            sscanf(value, "%f", &(landerstate.dO));
+    /* try variations on the PID command, keep the one that lands best */
+    if (planrollouts && cond.contact == Flying)
+    {
+        int best;
+        plans_generate(&plans, &cmd, &planseed);
+        best = predict(&defaultmodel, &st, &cond, &plans);
+        cmd.thrust = plans.thrust[0][best];
+        cmd.rotn = plans.rotn[0][best];
+        planscore = plans.score[best];
+    }
 
-        sem_post(&statelock); /*Exit critical section */
+    lock(&cmdlock);
+    /* the pilot may have taken over meanwhile */
+    if (autopilotengaged && !samecommand(&landercommand, &cmd))
+    {
+        landercommand = cmd;
+        version_bump(&commandversion);
     }
+    unlock(&cmdlock);
 }
 
-/* -------------------- Lander communication --------------------
+void *autopilot(void *data)
+{
+    autopilotinit();
+    while (true)
+    {
+        sem_wait(&samplesem);
+        while (sem_trywait(&samplesem) == 0)
+            ; /* only the latest sample matters */
+        autopilotcycle();
+        sem_post(&commandsem);
+    }
+}
 
-    Communicates with the lander model
-    Sends commands and queries state
-    Parses and decodes messages
+/* -------------------- Dashboard communication --------------------
 
-    Arguments:
-        data -> port number
+    Formats and sends data messages to the dashboards
+    The dashboard on the command line is always subscribed, others
+    register through the subscription server
 */
-void *lander(void *data)
+int dashboardsock;
+
+// Formats the subscribed fields, one "key:value" line each
+size_t formatdashboard(char *buffer, size_t size, unsigned fields)
 {
-    size_t msgsize = 1000;
-    char msgbuf[msgsize];
-    int l;
-    struct addrinfo *landr;
+    struct telemetry t;
+    struct state st;
+    struct condition cond;
+    struct command cmd;
+
+    currentstate(&st, &cond);
+    lock(&cmdlock);
+    cmd = landercommand;
+    unlock(&cmdlock);
+
+    telemetry_gather(&t, &cmd, &st, &cond);
+    return telemetry_format(buffer, size, &t, fields);
+}
 
-    const char conditionq[] = "condition:?\n";
-    const char stateq[] = "state:?\n";
+/* Accepts dashboard subscriptions */
+int subscriptionsock = -1;
 
-    // Get address and open a socket
-    if (!getaddr("127.0.1.1", (char *)data, &landr))
-        fprintf(stderr, "Can't get lander address\n");
-    ;
-    l = mksocket();
+// Opens the subscription socket on port, returns it or -1
+int subscriptionsopen(char *port)
+{
+    int s;
+    struct addrinfo *saddr;
 
-    while (true)
+    if (!getaddr(NULL, port, &saddr))
     {
-        int m;
-        usleep(50000); /* 20Hz = 0.05s = 50ms = 50000us */
-        /* poll for condition */
-        sendto(l, conditionq, strlen(conditionq), 0, landr->ai_addr,
-               landr->ai_addrlen);
-
-        m = recvfrom(l, msgbuf, msgsize, 0, NULL, NULL);
-        msgbuf[m] = '\0';
+        fprintf(stderr, "Cannot get subscription address\n");
+        return -1;
+    }
+    s = mksocket();
+    if (!bindsocket(s, saddr->ai_addr, saddr->ai_addrlen))
+        return -1;
+    return subscriptionsock = s;
+}
 
-        /* parse condition */
-        parsecondition(msgbuf);
+void *subscriptions(void *data)
+{
+    server(subscriptionsock, subscriptionhandler);
+    return NULL;
+}
 
-        /* poll for state */
-        sendto(l, stateq, strlen(stateq), 0, landr->ai_addr,
-               landr->ai_addrlen);
+/* Answers condition:? and state:? for local tools from the last replies,
+   so they don't each poll the lander (see proxy.h) */
 
-        m = recvfrom(l, msgbuf, msgsize, 0, NULL, NULL);
-        msgbuf[m] = '\0';
-        parsestate(msgbuf);
-
-        /* format command to send to lander */
-        sprintf(msgbuf,
-                "command:!\n"
-                "main-engine: %f\n"
-                "rcs-roll: %f\n",
-                landercommand.thrust, landercommand.rotn);
-        sendto(l, msgbuf, strlen(msgbuf), 0, landr->ai_addr, landr->ai_addrlen);
-        m = recvfrom(l, msgbuf, msgsize, 0, NULL, NULL);
-        msgbuf[m] = '\0';
+// Opens the proxy socket on port, returns it or -1
+int proxyopen(char *port)
+{
+    int s;
+    struct addrinfo *paddr;
 
-        usleep(100000);
+    if (!getaddr(NULL, port, &paddr))
+    {
+        fprintf(stderr, "Cannot get proxy address\n");
+        return -1;
     }
+    s = mksocket();
+    if (!bindsocket(s, paddr->ai_addr, paddr->ai_addrlen))
+        return -1;
+    return proxysock = s;
 }
 
-/* -------------------- Dashboard communication --------------------
+void *proxy(void *data)
+{
+    server(proxysock, proxyhandler);
+    return NULL;
+}
 
-    Formats and sends data messages to the dashboard
-*/
-void *dashboard(void *data)
+// Subscribes the dashboard on the command line and opens the socket for updates
+int dashboardopen(char *port)
 {
-    size_t bufsize = 1024;
-    char buffer[bufsize];
-    int d;
     struct addrinfo *daddr;
 
     // Get address and open a socket
-    if (!getaddr("127.0.1.1", (char *)data, &daddr))
+    if (!getaddr("127.0.1.1", port, &daddr))
         fprintf(stderr, "Canott get dashboard address");
+    else if (!subscribe((struct sockaddr_in *)daddr->ai_addr, F_FUEL | F_ALTITUDE, 2))
+        fprintf(stderr, "Cannot subscribe dashboard");
 
-    d = mksocket();
+    return dashboardsock = mksocket();
+}
 
-    while (true)
+int64_t dashboard(void *data)
+{
+    // Send the update to every dashboard that is due one and hasn't had it;
+    // both versions only go up, so their sum moves whenever either does
+    dashboardupdates += publish(dashboardsock, formatdashboard,
+                                version_read(&sampleversion) + version_read(&commandversion));
+    return 1000000000L / MAXRATE;
+}
+
+/* -------------------- Data Logging --------------------
+
+    Periodically (every 5 seconds) logs data to the flight log, a new
+    series of segment files in logdir every run (see flightlog.h)
+*/
+#define LOGSEGMENTSIZE (1024 * 1024)   /* bytes before starting a new segment */
+#define LOGSEGMENTAGE 3600000000000LL  /* ns, or this old */
+#define LOGSYNC 30000000000LL          /* ns, at most this much is lost in a crash */
+char *logdir = "flights";
+struct flightlog flightlog;
+
+void loggingopen(void)
+{
+    if (!flightlog_open(&flightlog, logdir, LOGSEGMENTSIZE, LOGSEGMENTAGE, LOGSYNC))
     {
-        int buffer_error = sprintf(buffer, "fuel:%f\naltitude:%f\n", landercond.fuel, landercond.altitude);
+        fprintf(stderr, "Flight log could not be opened or created\n");
+        exit(1);
+    }
+}
+
+int64_t datalogging(void *data)
+{
+    // Key pressed
+    char *key_pressed = "";
 
-        if (buffer_error == -1)
-            fprintf(stderr, "Error creating buffer array");
+    struct flightrecord rec;
+    char record[FLIGHTLOG_MAXRECORD];
+    size_t len;
+    struct state st;
+    struct condition cond;
+    struct command cmd;
 
-        // Send buffer with the message to the dashboard through socket
-        sendto(d, buffer, strlen(buffer), 0, daddr->ai_addr, daddr->ai_addrlen);
 
-        usleep(500000);
+    // Get currently pressed key
+    switch (last)
+    {
+    case KEY_UP:
+        key_pressed = "up";
+        break;
+    case KEY_DOWN:
+        key_pressed = "down";
+        break;
+    case KEY_LEFT:
+        key_pressed = "left";
+        break;
+    case KEY_RIGHT:
+        key_pressed = "right";
+        break;
+    default:
+        key_pressed = "none";
     }
+
+    // Get the latest sample, stamped with when it arrived
+    lock(&cmdlock);
+    cmd = landercommand;
+    unlock(&cmdlock);
+    lock(&condlock);
+    cond = landercond;
+    unlock(&condlock);
+    lock(&statelock);
+    st = landerstate;
+    rec.wall = (int64_t)landersampled.wall.tv_sec * 1000000000 + landersampled.wall.tv_nsec;
+    rec.mono = (int64_t)landersampled.mono.tv_sec * 1000000000 + landersampled.mono.tv_nsec;
+    unlock(&statelock);
+    if (rec.wall == 0)
+        return 5000000000LL; /* nothing from the lander yet */
+    telemetry_gather(&rec.t, &cmd, &st, &cond);
+    strncpy(rec.key, key_pressed, sizeof(rec.key));
+
+    // Append the record, the flight log syncs it to disk in its own time
+    len = flightrecord_pack(record, sizeof(record), &rec);
+    if (len == 0 || !flightlog_append(&flightlog, record, len))
+        fprintf(stderr, "Failed to write data log\n");
+
+    return 5000000000LL; // log data each 5 seconds
 }
 
-/* -------------------- Data Logging --------------------
+/* -------------------- Event Loop --------------------
 
-    Periodically (every 5 seconds) logs data to a file
+    The alternative to threads (-e): one thread waits in epoll for the
+    keyboard, lander replies, subscription requests and the period
+    timers, and runs whatever is ready to completion.  The lander cycle
+    becomes a state machine driven by replies and timeouts instead of
+    blocking requests, and the autopilot runs inline on each fresh
+    sample.  Nothing runs concurrently, so nothing is locked.
 */
-void *datalogging(void *data)
+enum
 {
-    FILE *fileptr;
+    EV_KEYBOARD = MAXTASKS, /* below this, the index of a timed task */
+    EV_LANDER,
+    EV_LANDERTIMER,
+    EV_SUBSCRIPTIONS,
+    EV_UPLINK,
+    EV_PROXY,
+    EV_COMMANDS
+};
+
+/* Where the lander cycle is up to; the phases are the fleet's */
+struct landercycle
+{
+    enum fleetphase phase;
+    const char *request; /* the request awaiting its reply */
+    size_t len;
+    int attempt;
+    char command[100];
+    struct command sent; /* the command in command[] */
+    int uplink;          /* sending a changed command between polls */
+    int pending;         /* a change arrived mid-cycle */
+};
 
-    // Open the data file
-    fileptr = fopen("log.csv", "w");
-    if (fileptr == NULL)
+static void addns(struct timespec *t, int64_t ns)
+{
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L)
     {
-        fprintf(stderr, "Log file could not be opened or created");
-        exit(1);
+        t->tv_nsec -= 1000000000L;
+        t->tv_sec++;
     }
+}
 
-    /* - Logged variables - */
-    const int message_size = 300;
-    const int round_numbers = 4;
-    char *delimiter = ",";
-
-    // Time
-    time_t raw_time;
-    struct tm *time_info;
-    char *current_time = "";
+// Sets a timerfd to go off once at an absolute time
+static void arm(int fd, const struct timespec *when)
+{
+    struct itimerspec t = {.it_value = *when};
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &t, NULL);
+}
 
-    // Key pressed
-    char *key_pressed = "";
+static void expired(int fd)
+{
+    uint64_t expirations;
+    while (read(fd, &expirations, sizeof(expirations)) == -1 && errno == EINTR)
+        ;
+}
 
-    // Lander command
-    char lander_thrust[10];
-    char lander_rotation[10];
+// Sends the request for the next phase and sets its reply timeout
+static void landersend(struct landercycle *lc, enum fleetphase phase,
+                       const char *request, size_t len)
+{
+    struct timespec deadline;
+
+    lc->phase = phase;
+    lc->request = request;
+    lc->len = len;
+    lc->attempt = 0;
+    landerlink.stats.requests++;
+    if (netsend(&landerlink, request, len) == -1)
+        landerlink.stats.senderrors++;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    addns(&deadline, replytimeout * 1000000LL);
+    arm(landerperiod.timerfd, &deadline);
+}
 
-    // Lander state
-    char lander_state_x[10];
-    char lander_state_y[10];
-    char lander_state_O[10];
+// Sends the command if it has changed, returns false if it hasn't
+static int landercommandsend(struct landercycle *lc)
+{
+    lc->sent = landercommand;
+    if (!commandchanged(&lc->sent))
+        return false;
+    formatcommand(lc->command, sizeof(lc->command), &lc->sent);
+    landersend(lc, AwaitCommand, lc->command, strlen(lc->command));
+    return true;
+}
 
-    char lander_state_dx[10];
-    char lander_state_dy[10];
-    char lander_state_dO[10];
+static void landeruplink(struct landercycle *lc);
 
-    // Lander condition
-    char lander_condition_fuel[10];
-    char lander_condition_altitude[10];
-    char *lander_condition_contact;
+// Moves the cycle on with the reply to the current phase, NULL if it never came
+static void landernext(struct landercycle *lc, char *reply)
+{
+    struct timespec now;
 
-    while (true)
+    switch (lc->phase)
     {
-        // Get current time
-        time(&raw_time);
-        time_info = localtime(&raw_time);
-        current_time = asctime(time_info);
-        current_time[strcspn(current_time, "\n")] = 0;
-
-        // Get currently pressed key
-        switch (last)
+    case Idle: /* released, start a cycle */
+        period_started(&landerperiod);
+        landersend(lc, AwaitCondition, conditionq, strlen(conditionq));
+        break;
+    case AwaitCondition:
+        if (reply)
         {
-        case KEY_UP:
-            key_pressed = "up";
-            break;
-        case KEY_DOWN:
-            key_pressed = "down";
-            break;
-        case KEY_LEFT:
-            key_pressed = "left";
-            break;
-        case KEY_RIGHT:
-            key_pressed = "right";
+            proxy_update(PROXY_CONDITION, reply, strlen(reply));
+            parsecondition(reply, &landercond, NULL);
+        }
+        landersend(lc, AwaitState, stateq, strlen(stateq));
+        break;
+    case AwaitState:
+        if (reply)
+        {
+            now = landerlink.rx.mono;
+            landersampled = landerlink.rx;
+            proxy_update(PROXY_STATE, reply, strlen(reply));
+            parsestate(reply, &landerstate, NULL);
+            estimator_update(&estimate, &landerstate, &landercond, &now);
+            history_add(&history, &now, &landercommand, &landerstate, &landercond);
+            version_bump(&sampleversion);
+            autopilotcycle();
+        }
+        if (landercommandsend(lc))
             break;
-        default:
-            key_pressed = "none";
+        unchanged++;
+        /* fall through, nothing to wait for */
+    case AwaitCommand:
+        if (lc->phase == AwaitCommand && reply)
+            commandacked(&lc->sent);
+        if (!lc->uplink)
+        {
+            if (live)
+                livestate_publish(live, &landercommand, &landerstate, &landercond);
+            landerrate = pollrate(&landercond, &landerstate, minrate, maxrate);
+            period_set(&landerperiod, 1000000000L / landerrate);
+            period_advance(&landerperiod);
         }
+        lc->phase = Idle;
+        lc->uplink = false;
+        arm(landerperiod.timerfd, &landerperiod.next);
+        if (lc->pending)
+            landeruplink(lc);
+        break;
+    }
+}
 
-        // Get current lander command
-        gcvt(landercommand.thrust, round_numbers, lander_thrust);
-        gcvt(landercommand.rotn, round_numbers, lander_rotation);
+// Sends a changed command between polls, or after this cycle if one is under way
+static void landeruplink(struct landercycle *lc)
+{
+    lc->pending = lc->phase != Idle;
+    if (lc->pending)
+        return;
+    lc->uplink = true;
+    if (landercommandsend(lc))
+        uplinks++;
+    else
+        lc->uplink = false;
+}
 
-        // Get current lander state
-        gcvt(landerstate.x, round_numbers, lander_state_x);
-        gcvt(landerstate.y, round_numbers, lander_state_y);
-        gcvt(landerstate.O, round_numbers, lander_state_O);
+// The lander timer: a release when idle, otherwise a reply timeout
+static void landertimeout(struct landercycle *lc)
+{
+    struct timespec deadline;
 
-        gcvt(landerstate.dx, round_numbers, lander_state_dx);
-        gcvt(landerstate.dy, round_numbers, lander_state_dy);
-        gcvt(landerstate.dO, round_numbers, lander_state_dO);
+    if (lc->phase == Idle)
+        landernext(lc, NULL);
+    else if (lc->attempt < retries)
+    {
+        lc->attempt++;
+        landerlink.stats.retries++;
+        if (netsend(&landerlink, lc->request, lc->len) == -1)
+            landerlink.stats.senderrors++;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        addns(&deadline, replytimeout * 1000000LL);
+        arm(landerperiod.timerfd, &deadline);
+    }
+    else
+    {
+        landerlink.stats.timeouts++;
+        landernext(lc, NULL);
+    }
+}
 
-        // Get current lander condition
-        gcvt(landercond.fuel, round_numbers, lander_condition_fuel);
-        gcvt(landercond.altitude, round_numbers, lander_condition_altitude);
-        if (landercond.contact)
-            lander_condition_contact = "true";
+// Handles every reply waiting on the lander socket
+static void landerreplies(struct landercycle *lc)
+{
+    char msgbuf[1000];
+    ssize_t m;
+
+    while ((m = netrecv(&landerlink, msgbuf, sizeof(msgbuf) - 1)) >= 0)
+    {
+        size_t key = strcspn(lc->request ? lc->request : "", ":");
+
+        msgbuf[m] = '\0';
+        if (lc->phase != Idle && strncmp(msgbuf, lc->request, key + 1) == 0)
+        {
+            landerlink.stats.replies++;
+            landerlink.stats.replyns +=
+                (landerlink.rx.wall.tv_sec - landerlink.sent.tv_sec) * 1000000000LL +
+                (landerlink.rx.wall.tv_nsec - landerlink.sent.tv_nsec);
+            landernext(lc, msgbuf);
+        }
         else
-            lander_condition_contact = "false";
-
-        // Build the string that will be logged
-        char log_text[message_size];
-        int string_building_error = sprintf(log_text, "{\"%s\":[{\"key\":\"%s\",\"lander\":[{\"command\":[{\"thrust \":\"%s\", \"rotation\":\"%s\"}], \"state\":[{\"x\":\"%s\", \"y\":\"%s\", \"O\":\"%s\", \"dx\":\"%s\", \"dy\":\"%s\", \"dO\":\"%s\"}], \"condition\":[{\"fuel\":\"%s\", \"altitude\":\"%s\", \"contact\":%s}]}]}]}",
-                                            current_time,
-                                            key_pressed,
-                                            lander_thrust,
-                                            lander_rotation,
-                                            lander_state_x,
-                                            lander_state_y,
-                                            lander_state_O,
-                                            lander_state_dx,
-                                            lander_state_dy,
-                                            lander_state_dO,
-                                            lander_condition_fuel,
-                                            lander_condition_altitude,
-                                            lander_condition_contact);
-        if (string_building_error == -1)
-            fprintf(stderr, "Failed to build data logging string");
-
-        // Write into the data file
-        fprintf(fileptr, "%s%s", log_text, delimiter);
-        fflush(fileptr); // Use fflush due to buffered IO
-
-        usleep(5000000); // Sleep 5 seconds -> log data each 5 seconds
-    }
-
-    // Close the data file
-    fclose(fileptr);
+            landerlink.stats.stale++; /* an answer to a retry, or very late */
+    }
+}
+
+// Adds fd to the epoll set, returns false on failure
+static int watch(int ep, int fd, uint32_t id)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = id};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        fprintf(stderr, "Cannot watch fd %d: %s\n", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Runs everything from one thread, does not return
+
+    tasks are the periodic tasks (dashboard, logging and the display or
+    a -H script), each
+    released by its period's timer.  subscriptionsock is -1 if not wanted.
+*/
+void eventmain(struct task *tasks, int ntasks, int subscriptionsock)
+{
+    struct epoll_event events[16];
+    struct landercycle lc = {.phase = Idle};
+    int ep, t;
+
+    if (landerlink.transport != UDP)
+    {
+        fprintf(stderr, "The event loop needs a datagram (udp: or unix:) lander link\n");
+        exit(1);
+    }
+    fcntl(landerlink.fd, F_SETFL, fcntl(landerlink.fd, F_GETFL) | O_NONBLOCK);
+    for (t = 0; t < ntasks; t++)
+        if (tasks[t].period->timerfd == -1 || landerperiod.timerfd == -1)
+        {
+            fprintf(stderr, "The event loop needs timerfd\n");
+            exit(1);
+        }
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep == -1)
+    {
+        fprintf(stderr, "Cannot create epoll: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (!headless)
+        watch(ep, STDIN_FILENO, EV_KEYBOARD);
+    if (commandsock != -1)
+        watch(ep, commandsock, EV_COMMANDS);
+    watch(ep, landerlink.fd, EV_LANDER);
+    watch(ep, landerperiod.timerfd, EV_LANDERTIMER);
+    if (subscriptionsock != -1)
+        watch(ep, subscriptionsock, EV_SUBSCRIPTIONS);
+    if (uplinktask && uplinktask->wake)
+        watch(ep, uplinktask->wakefd, EV_UPLINK);
+    if (proxysock != -1)
+        watch(ep, proxysock, EV_PROXY);
+    for (t = 0; t < ntasks; t++)
+    {
+        watch(ep, tasks[t].period->timerfd, t);
+        arm(tasks[t].period->timerfd, &tasks[t].period->next);
+    }
+    arm(landerperiod.timerfd, &landerperiod.next);
+    autopilotinit();
+
+    while (true)
+    {
+        int n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), -1);
+        int e;
+
+        for (e = 0; e < n; e++)
+        {
+            uint32_t id = events[e].data.u32;
+            switch (id)
+            {
+            case EV_KEYBOARD:
+                keyboard(NULL);
+                break;
+            case EV_LANDER:
+                landerreplies(&lc);
+                break;
+            case EV_LANDERTIMER:
+                expired(landerperiod.timerfd);
+                landertimeout(&lc);
+                break;
+            case EV_SUBSCRIPTIONS:
+                serverready(subscriptionsock, subscriptionhandler);
+                break;
+            case EV_UPLINK:
+                task_woken(uplinktask);
+                landeruplink(&lc);
+                break;
+            case EV_PROXY:
+                serverready(proxysock, proxyhandler);
+                break;
+            case EV_COMMANDS:
+                commandsready();
+                break;
+            default: /* a periodic task is due */
+            {
+                struct task *task = &tasks[id];
+                int64_t ns;
+
+                expired(task->period->timerfd);
+                period_started(task->period);
+                if ((ns = task->step(task->arg)) < 0)
+                {
+                    epoll_ctl(ep, EPOLL_CTL_DEL, task->period->timerfd, NULL);
+                    break;
+                }
+                period_set(task->period, ns);
+                period_advance(task->period);
+                arm(task->period->timerfd, &task->period->next);
+            }
+            }
+        }
+    }
 }
 
 /* -------------------- MAIN --------------------
 
 Arguments:
-    argv[1] -> lander
+    argv[1] -> lander, port or [udp:|tcp:|tcpline:]host:port
     argv[2] -> dashboard
+
+Options:
+    -s port -> accept dashboard subscriptions on port
+    -f list -> fleet mode, control every lander in the comma separated
+               host:port list (or @file, one per line) from one thread
+    -m file -> keep the latest command/state/condition in a memory-mapped
+               file for monitors (see monitor.c)
+    -t ms   -> how long to wait for each lander reply (default 40)
+    -r n    -> how many times to resend an unanswered request (default 2)
+    -p min:max -> bounds on the lander poll rate in Hz (default 1:20),
+               it rises as the lander nears touchdown
+    -R prio -> run the lander thread SCHED_FIFO at prio, with memory locked
+    -c thread:cpu,... -> pin threads (keyboard, display, lander, dashboard,
+               logging, autopilot) to cpus
+    -a      -> start with the autopilot engaged ('a' toggles it, arrow keys
+               take over)
+    -P n    -> the autopilot simulates n candidate plans ahead every cycle
+               and flies the best
+    -w n    -> run keyboard, display, lander, dashboard and logging as tasks
+               on a pool of n worker threads instead of a thread each
+               (-c does not apply, -R makes the workers real-time)
+    -e      -> run everything from one thread in an epoll event loop
+               (datagram lander links only, -R applies to that thread)
+    -l dir  -> keep the flight log in dir (default flights)
+    -q port -> answer condition:? and state:? on port from the latest
+               lander replies, for tools that would otherwise poll it
+    -Q ms   -> the oldest reply -q will serve (default 1000)
+    -b us   -> wait for lander replies by spinning for up to us before
+               blocking, and show the cpu it costs and the wake-up time it
+               saves (-b 0 just measures; not with -e or shm:)
+    -H file|unix:path -> headless: no console, display or keyboard, the
+               commands come from a script file or a unix datagram socket
 */
+void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-a] [-e] [-P n] [-w n] [-s port] [-m file] [-t ms] [-r n] [-p min:max]\n"
+                    "       [-R prio] [-c thread:cpu,...] [-l dir] [-q port] [-Q ms]\n"
+                    "       [-b us] [-H file|unix:path] lander dashboard\n"
+                    "       %s -f host:port,...|@file\n",
+            name, name);
+    exit(1);
+}
+
+// Fleet mode: keyboard, fleet display and one I/O thread for every lander
+int fleetmain(char *list)
+{
+    pthread_t keyboard_thread, display_thread, fleet_thread;
+    static struct fleetcommand fleetcommand = {&landercommand, &cmdlock};
+    struct task keyboardtask = {"keyboard", keyboard, NULL, &keyboardperiod};
+    struct task displaytask = {"display", fleetdisplay, NULL, &displayperiod};
+    int thread_error;
+
+    if (fleetload(list) == 0)
+    {
+        fprintf(stderr, "No landers in fleet\n");
+        return 1;
+    }
+    sem_init(&cmdlock, 0, 1);
+
+    console_init();
+
+    period_init(&keyboardperiod, KEYPERIOD);
+    period_init(&displayperiod, 500000000L);
+
+    if ((thread_error = rt_create(&display_thread, "display", task_thread, &displaytask)))
+        fprintf(stderr, "Failed creating display thread: %s\n", strerror(thread_error));
+
+    if ((thread_error = rt_create(&keyboard_thread, "keyboard", task_thread, &keyboardtask)))
+        fprintf(stderr, "Failed creating keyboard thread: %s\n", strerror(thread_error));
+
+    if ((thread_error = rt_create(&fleet_thread, "fleet", fleetloop, &fleetcommand)))
+        fprintf(stderr, "Failed creating fleet thread: %s\n", strerror(thread_error));
+
+    pthread_join(display_thread, NULL);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    pthread_t keyboard_thread;     // Keyboard
-    pthread_t display_thread;      // Display
-    pthread_t lander_thread;       // Lander
-    pthread_t dashboard_thread;    // Dashboard
-    pthread_t data_logging_thread; // Data logging
+    // The periodic work, a thread each or tasks on the executor's workers;
+    // headless runs only the first three, and a -H script in the fourth's place
+    struct task tasks[] = {{"lander", lander, NULL, &landerperiod},
+                           {"dashboard", dashboard, NULL, &dashboardperiod, .follows = &sampleversion},
+                           {"logging", datalogging, NULL, &loggingperiod},
+                           {"keyboard", keyboard, NULL, &keyboardperiod},
+                           {"display", display, NULL, &displayperiod, .follows = &sampleversion,
+                            .spacing = DISPLAYSPACING}};
+    int ntasks = sizeof(tasks) / sizeof(tasks[0]);
+    struct task *landertask = &tasks[0];
+    pthread_t task_threads[sizeof(tasks) / sizeof(tasks[0])];
+    pthread_t subscription_thread;   // Dashboard subscriptions
+    pthread_t proxy_thread;          // Lander query proxy
+    pthread_t commands_thread;       // -H unix: commands
+    pthread_t autopilot_thread;      // Autopilot
 
     int thread_error;
+    int opt, t;
+    int workers = 0;
+    char *subscriptionport = NULL;
+    char *proxyport = NULL;
+    long spinbudget = -1; /* us, -1 to block at once */
+    char *fleetlist = NULL;
+    int rtpriority = 0;
+    char *affinity = NULL;
+
+    // --- Parse options ---
+    while ((opt = getopt(argc, argv, "aeP:w:s:f:m:t:r:p:R:c:l:q:Q:b:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            subscriptionport = optarg;
+            break;
+        case 'f':
+            fleetlist = optarg;
+            break;
+        case 'm':
+            if ((live = livestate_create(optarg)) == NULL)
+                exit(1);
+            break;
+        case 't':
+            replytimeout = atol(optarg);
+            break;
+        case 'r':
+            retries = atoi(optarg);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%f:%f", &minrate, &maxrate) != 2 ||
+                minrate <= 0 || maxrate < minrate)
+                usage(argv[0]);
+            break;
+        case 'R':
+            rtpriority = atoi(optarg);
+            break;
+        case 'c':
+            affinity = optarg;
+            break;
+        case 'a':
+            autopilotengaged = true;
+            break;
+        case 'P':
+            if ((planrollouts = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'e':
+            eventloop = true;
+            break;
+        case 'l':
+            logdir = optarg;
+            break;
+        case 'q':
+            proxyport = optarg;
+            break;
+        case 'Q':
+            proxy_maxage(atol(optarg) * 1000000LL);
+            break;
+        case 'b':
+            spinbudget = atol(optarg);
+            break;
+        case 'H':
+            if (!commandsopen(optarg))
+                exit(1);
+            headless = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (fleetlist)
+        return fleetmain(fleetlist);
+    if (argc - optind < 2)
+        usage(argv[0]);
+    char *landerport = argv[optind];
+    char *dashboardport = argv[optind + 1];
 
     // Initialize semaphores
     sem_init(&condlock, 0, 1);
     sem_init(&statelock, 0, 1);
     sem_init(&cmdlock, 0, 1);
+    sem_init(&samplesem, 0, 0);
+    sem_init(&commandsem, 0, 0);
+    estimator_init(&estimate);
+    history_init(&history);
 
-    // Initialize the console display
-    console_init();
+    // Open the lander link, dashboard socket and log before taking over the screen
+    if (!landeropen(landerport))
+        exit(1);
+    if (spinbudget >= 0 && (eventloop || !netbusypoll(&landerlink, spinbudget * 1000)))
+        fprintf(stderr, "Busy polling needs a socket lander link and no -e, ignoring -b\n");
+    dashboardopen(dashboardport);
+    loggingopen();
+    if (subscriptionport && subscriptionsopen(subscriptionport) == -1)
+        exit(1);
+    if (proxyport && proxyopen(proxyport) == -1)
+        exit(1);
+
+    period_init(&keyboardperiod, KEYPERIOD);
+    period_init(&displayperiod, DISPLAYPERIOD);
+    period_init(&landerperiod, 1000000000L / landerrate);
+    period_init(&dashboardperiod, 1000000000L / MAXRATE);
+    period_init(&loggingperiod, 5000000000LL);
+
+    // Command changes at the keyboard go straight to the lander
+    if (task_wakeable(landertask, uplink))
+        uplinktask = landertask;
+
+    // Initialize the console display, or do without
+    if (headless)
+    {
+        ntasks = 3;
+        if (commandscript)
+        {
+            tasks[ntasks].name = "commands";
+            tasks[ntasks++].step = script;
+        }
+    }
+    else
+    {
+        if (eventloop)
+            console_single_threaded();
+        console_init();
+    }
+
+    // --- Event loop: this thread does the lot ---
+    if (eventloop)
+    {
+        if (rtpriority)
+        {
+            rt_lockmemory();
+            rt_thread(pthread_self(), "event loop", rtpriority, -1);
+        }
+        /* dashboard, logging, and the display or a -H script */
+        struct task timed[] = {tasks[1], tasks[2], tasks[headless ? 3 : 4]};
+        eventmain(timed, headless ? ntasks - 1 : 3, subscriptionsock);
+    }
 
     // --- Create threads ---
 
-    // Display thread
-    if ((thread_error = pthread_create(&display_thread, NULL, display, NULL)))
-        fprintf(stderr, "Failed creating display thread: %s\n", strerror(thread_error));
+    if (workers > 0)
+    {
+        // Executor: every periodic task shares the worker pool
+        for (t = 0; t < ntasks; t++)
+            executor_add(&tasks[t]);
+        executor_start(workers);
+    }
+    else
+    {
+        // One thread per task
+        for (t = 0; t < ntasks; t++)
+            if ((thread_error = rt_create(&task_threads[t], tasks[t].name, task_thread, &tasks[t])))
+                fprintf(stderr, "Failed creating %s thread: %s\n",
+                        tasks[t].name, strerror(thread_error));
+    }
 
-    // Keyboard thread
-    if ((thread_error = pthread_create(&keyboard_thread, NULL, keyboard, NULL)))
-        fprintf(stderr, "Failed creating keyboard thread: %s\n", strerror(thread_error));
+    // Subscription thread
+    if (subscriptionport &&
+        (thread_error = rt_create(&subscription_thread, "subscription", subscriptions, NULL)))
+        fprintf(stderr, "Failed creating subscription thread: %s\n", strerror(thread_error));
 
-    // Lander thread
-    if ((thread_error = pthread_create(&lander_thread, NULL, lander, argv[1])))
-        fprintf(stderr, "Failed creating lander thread: %s\n", strerror(thread_error));
+    // Proxy thread
+    if (proxyport &&
+        (thread_error = rt_create(&proxy_thread, "proxy", proxy, NULL)))
+        fprintf(stderr, "Failed creating proxy thread: %s\n", strerror(thread_error));
 
-    // Dashboard thread
-    if ((thread_error = pthread_create(&dashboard_thread, NULL, dashboard, argv[2])))
-        fprintf(stderr, "Failed creating dashboard thread: %s\n", strerror(thread_error));
+    // Headless command socket thread
+    if (commandsock != -1 &&
+        (thread_error = rt_create(&commands_thread, "commands", commands, NULL)))
+        fprintf(stderr, "Failed creating commands thread: %s\n", strerror(thread_error));
 
-    // Data logging thread
-    if ((thread_error = pthread_create(&data_logging_thread, NULL, datalogging, NULL)))
-        fprintf(stderr, "Failed creating data logging thread: %s\n", strerror(thread_error));
+    // Autopilot thread
+    if ((thread_error = rt_create(&autopilot_thread, "autopilot", autopilot, NULL)))
+        fprintf(stderr, "Failed creating autopilot thread: %s\n", strerror(thread_error));
 
-    pthread_join(display_thread, NULL);
+    // --- Real-time scheduling ---
+    if (rtpriority)
+    {
+        rt_lockmemory();
+        if (workers > 0)
+            executor_rt(rtpriority);
+        else
+            rt_thread(task_threads[landertask - tasks], "lander", rtpriority, -1);
+        rt_thread(autopilot_thread, "autopilot", rtpriority, -1);
+    }
+    if (affinity && workers == 0)
+    {
+        char *item, *rest;
+        for (item = strtok_r(affinity, ",", &rest); item; item = strtok_r(NULL, ",", &rest))
+        {
+            char name[16];
+            int cpu;
+            if (sscanf(item, "%15[^:]:%d", name, &cpu) != 2)
+                continue;
+            for (t = 0; t < ntasks; t++)
+                if (strcmp(name, tasks[t].name) == 0)
+                    rt_thread(task_threads[t], name, 0, cpu);
+            if (strcmp(name, "autopilot") == 0)
+                rt_thread(autopilot_thread, name, 0, cpu);
+        }
+    }
+
+    pthread_join(autopilot_thread, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+/* State Estimator
+ * KV5002
+ */
+#include <string.h>
+
+#include "estimator.h"
+
+#define ACCELGAIN 0.5   /* weight of a new acceleration measurement */
+#define MAXHORIZON 1.0  /* s, never extrapolate further than this */
+
+static float seconds(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+void estimator_init(struct estimator *e)
+{
+    memset(e, 0, sizeof(*e));
+    sem_init(&e->lock, 0, 1);
+}
+
+void estimator_update(struct estimator *e, const struct state *st,
+                      const struct condition *cond, const struct timespec *when)
+{
+    float dt;
+
+    sem_wait(&e->lock);
+    dt = seconds(when, &e->when);
+
+    if (e->samples && dt > 0 && dt < MAXHORIZON && cond->contact == Flying)
+    {
+        e->ax += ACCELGAIN * ((st->dx - e->sample.dx) / dt - e->ax);
+        e->ay += ACCELGAIN * ((st->dy - e->sample.dy) / dt - e->ay);
+        e->aO += ACCELGAIN * ((st->dO - e->sample.dO) / dt - e->aO);
+    }
+    else
+        e->ax = e->ay = e->aO = 0;
+
+    e->sample = *st;
+    e->altitude = cond->altitude;
+    e->flying = cond->contact == Flying;
+    e->when = *when;
+    e->samples++;
+    sem_post(&e->lock);
+}
+
+void estimator_predict(struct estimator *e, const struct timespec *when,
+                       struct state *st, float *altitude)
+{
+    float t;
+
+    sem_wait(&e->lock);
+    *st = e->sample;
+    if (altitude)
+        *altitude = e->altitude;
+
+    t = seconds(when, &e->when);
+    if (e->flying && t > 0)
+    {
+        if (t > MAXHORIZON)
+            t = MAXHORIZON;
+        st->x += e->sample.dx * t + 0.5 * e->ax * t * t;
+        st->y += e->sample.dy * t + 0.5 * e->ay * t * t;
+        st->O += e->sample.dO * t + 0.5 * e->aO * t * t;
+        st->dx += e->ax * t;
+        st->dy += e->ay * t;
+        st->dO += e->aO * t;
+        if (altitude)
+            *altitude += st->y - e->sample.y;
+    }
+    sem_post(&e->lock);
+}
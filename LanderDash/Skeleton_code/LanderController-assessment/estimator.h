@@ -0,0 +1,39 @@
+/* State Estimator
+ * KV5002
+ *
+ * Predicts the lander's state at any instant between polls.  Each axis
+ * (x, y, O) follows a constant-acceleration model: position and velocity
+ * come from the latest sample and the acceleration is estimated from the
+ * change in velocity between samples, smoothed.  Every real sample
+ * corrects the model.
+ */
+#ifndef _ESTIMATOR_H
+#define _ESTIMATOR_H
+
+#include <time.h>
+#include <semaphore.h>
+
+#include "lander.h"
+
+struct estimator
+{
+    sem_t lock;
+    struct timespec when;       /* time of the last sample */
+    struct state sample;        /* the last sample */
+    float altitude;             /* altitude at the last sample */
+    int flying;                 /* extrapolate only while flying */
+    float ax, ay, aO;           /* estimated accelerations */
+    unsigned long samples;
+};
+
+void estimator_init(struct estimator *e);
+
+/* Correct the model with a new sample taken at when */
+void estimator_update(struct estimator *e, const struct state *st,
+                      const struct condition *cond, const struct timespec *when);
+
+/* Predict the state (and altitude, if not NULL) at when */
+void estimator_predict(struct estimator *e, const struct timespec *when,
+                       struct state *st, float *altitude);
+
+#endif
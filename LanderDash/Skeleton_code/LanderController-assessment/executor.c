@@ -0,0 +1,321 @@
+/* Task Executor
+ * KV5002
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+
+#include "rt.h"
+#include "executor.h"
+
+/* Tasks waiting for their next release, a binary heap on period->next.
+   One idle worker at a time sleeps until the earliest is due (timing),
+   the others sleep until there is something for them to do, so a
+   release wakes one thread rather than the whole pool. */
+static struct task *queue[MAXTASKS];
+static int queued = 0;
+static bool timing = false;
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timerwake; /* the earliest release changed */
+static pthread_cond_t idlewake;  /* a worker is needed */
+static pthread_once_t queueonce = PTHREAD_ONCE_INIT;
+
+static pthread_t workers[MAXWORKERS];
+static int nworkers = 0;
+
+static void queueinit(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* same clock as the periods */
+    pthread_cond_init(&timerwake, &attr);
+    pthread_cond_init(&idlewake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static bool before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static bool earlier(int a, int b)
+{
+    return before(&queue[a]->period->next, &queue[b]->period->next);
+}
+
+static void swap(int a, int b)
+{
+    struct task *t = queue[a];
+    queue[a] = queue[b];
+    queue[b] = t;
+}
+
+static int siftup(int i)
+{
+    while (i > 0 && earlier(i, (i - 1) / 2))
+    {
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return i;
+}
+
+static void siftdown(int i)
+{
+    while (true)
+    {
+        int c = 2 * i + 1;
+        if (c >= queued)
+            break;
+        if (c + 1 < queued && earlier(c + 1, c))
+            c++;
+        if (!earlier(c, i))
+            break;
+        swap(i, c);
+        i = c;
+    }
+}
+
+// Adds a task to the heap and wakes a worker if it is now the earliest, queuelock held
+static void push(struct task *t)
+{
+    queue[queued] = t;
+    if (siftup(queued++) == 0)
+        pthread_cond_signal(timing ? &timerwake : &idlewake);
+}
+
+// Removes task i from the heap, queuelock held
+static struct task *removeat(int i)
+{
+    struct task *t = queue[i];
+
+    queue[i] = queue[--queued];
+    if (i < queued)
+    {
+        siftdown(i);
+        siftup(i);
+    }
+    return t;
+}
+
+// Removes the earliest task from the heap, queuelock held
+static struct task *pop(void)
+{
+    return removeat(0);
+}
+
+int executor_add(struct task *t)
+{
+    pthread_once(&queueonce, queueinit);
+    pthread_mutex_lock(&queuelock);
+    if (queued == MAXTASKS)
+    {
+        pthread_mutex_unlock(&queuelock);
+        fprintf(stderr, "Too many tasks, not running %s\n", t->name);
+        return false;
+    }
+    push(t);
+    pthread_mutex_unlock(&queuelock);
+    return true;
+}
+
+static void *worker(void *data)
+{
+    pthread_mutex_lock(&queuelock);
+    while (true)
+    {
+        struct timespec now;
+        struct task *t;
+        int64_t ns;
+        int i;
+
+        /* a woken task runs its wake function first, then goes back
+           in the queue for the release it was already waiting for */
+        for (i = 0; i < queued && !queue[i]->woken; i++)
+            ;
+        if (i < queued)
+        {
+            t = removeat(i);
+            pthread_mutex_unlock(&queuelock);
+            task_woken(t);
+            t->wake(t->arg);
+            pthread_mutex_lock(&queuelock);
+            push(t);
+            continue;
+        }
+
+        if (queued == 0 || timing)
+        {
+            pthread_cond_wait(&idlewake, &queuelock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (before(&now, &queue[0]->period->next))
+        {
+            /* copy the deadline, the head may change while we sleep */
+            struct timespec due = queue[0]->period->next;
+            timing = true;
+            pthread_cond_timedwait(&timerwake, &queuelock, &due);
+            timing = false;
+            continue;
+        }
+
+        t = pop();
+        if (queued)
+            pthread_cond_signal(&idlewake); /* someone else watches the queue */
+        pthread_mutex_unlock(&queuelock);
+
+        period_started(t->period);
+        ns = t->step(t->arg);
+
+        pthread_mutex_lock(&queuelock);
+        if (ns >= 0)
+        {
+            period_set(t->period, ns);
+            period_advance(t->period);
+            push(t);
+        }
+    }
+    return NULL;
+}
+
+int executor_start(int n)
+{
+    pthread_once(&queueonce, queueinit);
+    if (n > MAXWORKERS)
+        n = MAXWORKERS;
+    while (nworkers < n)
+    {
+        int err = rt_create(&workers[nworkers], "worker", worker, NULL);
+        if (err)
+        {
+            fprintf(stderr, "Failed creating worker thread: %s\n", strerror(err));
+            break;
+        }
+        nworkers++;
+    }
+    return nworkers;
+}
+
+void executor_rt(int priority)
+{
+    int i;
+    for (i = 0; i < nworkers; i++)
+        rt_thread(workers[i], "worker", priority, -1);
+}
+
+static int64_t sincens(const struct timespec *now, const struct timespec *then)
+{
+    return (int64_t)(now->tv_sec - then->tv_sec) * 1000000000L + (now->tv_nsec - then->tv_nsec);
+}
+
+/* Waits for the next release or for the version the task follows to move
+   on, true for the version.  A move less than spacing after the last step
+   waits out the rest of it, taking in any further moves meanwhile. */
+static int follow(struct task *t)
+{
+    struct timespec now;
+    int64_t left, early;
+    uint32_t v;
+
+    while (true)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = -sincens(&now, &t->period->next);
+        if (left <= 0)
+            break;
+        v = version_wait(t->follows, t->seen, left);
+        if (v == t->seen)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        early = t->spacing - sincens(&now, &t->stepped);
+        left = -sincens(&now, &t->period->next);
+        if (early > left)
+            early = left; /* the release comes first */
+        if (early > 0)
+        {
+            struct timespec rest = {.tv_sec = early / 1000000000L, .tv_nsec = early % 1000000000L};
+            clock_nanosleep(CLOCK_MONOTONIC, 0, &rest, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (sincens(&now, &t->period->next) >= 0)
+                break;
+        }
+        t->seen = version_read(t->follows);
+        t->period->next = now; /* the next release is a period from this step */
+        t->stepped = now;
+        return true;
+    }
+    t->stepped = now;
+    return false;
+}
+
+void *task_thread(void *data)
+{
+    struct task *t = data;
+    int64_t ns;
+
+    while ((ns = t->step(t->arg)) >= 0)
+    {
+        period_set(t->period, ns);
+        if (!period_advance(t->period))
+            continue; /* overran, go again now */
+        if (t->follows)
+        {
+            if (follow(t))
+                continue;
+        }
+        else
+            while (!period_sleep(t->period, t->wake ? t->wakefd : -1))
+            {
+                task_woken(t);
+                t->wake(t->arg);
+            }
+        period_started(t->period);
+    }
+    return NULL;
+}
+
+int task_wakeable(struct task *t, void (*wake)(void *arg))
+{
+    t->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->wakefd == -1)
+    {
+        fprintf(stderr, "Cannot make %s wakeable: %s\n", t->name, strerror(errno));
+        return false;
+    }
+    t->wake = wake;
+    return true;
+}
+
+void task_wake(struct task *t)
+{
+    uint64_t one = 1;
+
+    if (t->wake == NULL)
+        return;
+    pthread_once(&queueonce, queueinit);
+    pthread_mutex_lock(&queuelock);
+    t->woken = true;
+    pthread_cond_signal(timing ? &timerwake : &idlewake); /* if it is on the executor */
+    pthread_mutex_unlock(&queuelock);
+    write(t->wakefd, &one, sizeof(one)); /* if it has a thread or an event loop */
+}
+
+void task_woken(struct task *t)
+{
+    uint64_t count;
+
+    pthread_mutex_lock(&queuelock);
+    t->woken = false;
+    pthread_mutex_unlock(&queuelock);
+    read(t->wakefd, &count, sizeof(count));
+}
@@ -0,0 +1,66 @@
+/* Task Executor
+ * KV5002
+ *
+ * Runs periodic tasks on a fixed pool of worker threads instead of one
+ * thread per task.  Tasks wait in a queue ordered by their next release;
+ * an idle worker sleeps until the earliest one is due, runs one step of
+ * it and puts it back for its next release.  A task never runs on two
+ * workers at once.
+ */
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include <pthread.h>
+
+#include "rt.h"
+#include "version.h"
+
+#define MAXTASKS 16
+#define MAXWORKERS 16
+
+/* One step of a task, returns ns until the next step or -1 to stop */
+typedef int64_t (*step_t)(void *arg);
+
+struct task
+{
+    const char *name;
+    step_t step;
+    void *arg;
+    struct period *period; /* release times and their missed/latency counts */
+    void (*wake)(void *arg); /* run by task_wake(), NULL if it can't be woken */
+    int wakefd;              /* eventfd behind task_wake() */
+    int woken;
+    struct version *follows; /* if not NULL, step as soon as it moves on too */
+    uint32_t seen;           /* the version follows was at */
+    int64_t spacing;         /* ns, the least time between steps follows starts */
+    struct timespec stepped; /* when it last stepped */
+};
+
+/* Queue a task, its first step is due at period->next */
+int executor_add(struct task *t);
+
+/* Start the workers, returns the number started */
+int executor_start(int workers);
+
+/* Make every worker SCHED_FIFO at priority */
+void executor_rt(int priority);
+
+/* Thread function running a single task on its own, data -> the task.
+   A task that follows a version steps when it moves on as well as at
+   each release, but no sooner than spacing after its last step, and its
+   next release is a period after that step.  On
+   the executor it steps only at its releases (follows is ignored). */
+void *task_thread(void *data);
+
+/* Lets task_wake() run wake(arg) for the task, returns false on failure */
+int task_wakeable(struct task *t, void (*wake)(void *arg));
+
+/* Runs the task's wake function as soon as it is not in the middle of a
+   step, whether it has its own thread or is on the executor, without
+   moving its next release.  Wakes that arrive together run it once. */
+void task_wake(struct task *t);
+
+/* Clears a wake, for anyone watching wakefd themselves */
+void task_woken(struct task *t);
+
+#endif
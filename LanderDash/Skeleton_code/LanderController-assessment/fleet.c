@@ -0,0 +1,295 @@
+/* Lander Fleet
+ * KV5002
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include <semaphore.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libnet.h"
+#include "lander.h"
+#include "fleet.h"
+
+struct landerctx fleet[MAXFLEET];
+int fleetsize = 0;
+sem_t fleetlock;
+
+/* Replies are matched to landers by source address through a hash table
+   of fleet indices (+1 so that 0 means empty), sized to stay sparse */
+#define HASHSIZE (4 * MAXFLEET)
+static int buckets[HASHSIZE];
+
+static unsigned hashaddr(const struct sockaddr_in *a)
+{
+    unsigned h = ntohl(a->sin_addr.s_addr) * 2654435761u ^ ntohs(a->sin_port) * 40503u;
+    return h % HASHSIZE;
+}
+
+static struct landerctx *lookup(const struct sockaddr_in *a)
+{
+    unsigned h;
+    for (h = hashaddr(a); buckets[h]; h = (h + 1) % HASHSIZE)
+    {
+        struct landerctx *c = &fleet[buckets[h] - 1];
+        if (c->addr.sin_addr.s_addr == a->sin_addr.s_addr && c->addr.sin_port == a->sin_port)
+            return c;
+    }
+    return NULL;
+}
+
+// Adds one host:port lander, returns false if it can't be resolved
+static int fleetadd(const char *hostport)
+{
+    char host[64];
+    char *port;
+    struct addrinfo *addr;
+    struct landerctx *c;
+    unsigned h;
+
+    if (fleetsize == MAXFLEET)
+    {
+        fprintf(stderr, "Fleet is full, ignoring %s\n", hostport);
+        return false;
+    }
+
+    snprintf(host, sizeof(host), "%s", hostport);
+    port = strrchr(host, ':');
+    if (port == NULL)
+    {
+        fprintf(stderr, "Lander %s is not host:port\n", hostport);
+        return false;
+    }
+    *port++ = '\0';
+
+    if (!getaddr(host, port, &addr))
+        return false;
+
+    c = &fleet[fleetsize];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", hostport);
+    c->addr = *(struct sockaddr_in *)addr->ai_addr;
+    freeaddrinfo(addr);
+
+    if (lookup(&c->addr))
+    {
+        fprintf(stderr, "Lander %s is listed twice\n", hostport);
+        return false;
+    }
+    for (h = hashaddr(&c->addr); buckets[h]; h = (h + 1) % HASHSIZE)
+        ;
+    buckets[h] = ++fleetsize;
+    return true;
+}
+
+int fleetload(const char *list)
+{
+    static bool initialised = false;
+    int added = 0;
+
+    if (!initialised)
+    {
+        sem_init(&fleetlock, 0, 1);
+        initialised = true;
+    }
+
+    if (list[0] == '@')
+    {
+        char line[128];
+        FILE *f = fopen(list + 1, "r");
+        if (f == NULL)
+        {
+            fprintf(stderr, "Cannot open fleet file %s: %s\n", list + 1, strerror(errno));
+            return 0;
+        }
+        while (fgets(line, sizeof(line), f))
+        {
+            line[strcspn(line, " \t\r\n#")] = '\0';
+            if (line[0] && fleetadd(line))
+                added++;
+        }
+        fclose(f);
+    }
+    else
+    {
+        char copy[strlen(list) + 1];
+        char *item, *rest;
+        strcpy(copy, list);
+        for (item = strtok_r(copy, ",", &rest); item; item = strtok_r(NULL, ",", &rest))
+            if (fleetadd(item))
+                added++;
+    }
+    return added;
+}
+
+static void addns(struct timespec *t, long ns)
+{
+    t->tv_nsec += ns;
+    while (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_nsec -= 1000000000L;
+        t->tv_sec++;
+    }
+}
+
+static long diffns(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+static void sendto_lander(int sock, struct landerctx *c, const char *msg, size_t len)
+{
+    sendto(sock, msg, len, 0, (struct sockaddr *)&c->addr, sizeof(c->addr));
+}
+
+/* The key a reply in each phase starts with, as it would be if a state or
+   command reply came in after its cycle timed out and the next one began */
+static const char *const phasekeys[] = {
+    [Idle] = NULL,
+    [AwaitCondition] = "condition:",
+    [AwaitState] = "state:",
+    [AwaitCommand] = "command:",
+};
+
+// Handles a reply from a lander and sends the next message of its cycle
+static void advance(int sock, struct landerctx *c, char *msg,
+                    const char *command, int commandlen, const struct timespec *now)
+{
+    const char *key;
+
+    sem_wait(&fleetlock);
+    key = phasekeys[c->phase];
+    if (key == NULL || strncmp(msg, key, strlen(key)) != 0)
+    {
+        c->stale++; /* late reply to a cycle that timed out */
+        sem_post(&fleetlock);
+        return;
+    }
+    switch (c->phase)
+    {
+    case AwaitCondition:
+        parsecondition(msg, &c->cond, NULL);
+        sendto_lander(sock, c, stateq, strlen(stateq));
+        c->phase = AwaitState;
+        c->deadline = *now;
+        addns(&c->deadline, FLEETTIMEOUT);
+        break;
+    case AwaitState:
+        parsestate(msg, &c->state, NULL);
+        sendto_lander(sock, c, command, commandlen);
+        c->phase = AwaitCommand;
+        c->deadline = *now;
+        addns(&c->deadline, FLEETTIMEOUT);
+        break;
+    case AwaitCommand:
+        c->cycles++;
+        c->phase = Idle;
+        c->deadline = c->cycle;
+        addns(&c->deadline, FLEETPERIOD);
+        break;
+    case Idle:
+        break;
+    }
+    sem_post(&fleetlock);
+}
+
+/* -------------------- Fleet I/O loop --------------------
+
+    One thread, one socket.  Each pass sends whatever is due, works out
+    the nearest deadline and waits in poll() until then or a reply.
+*/
+void *fleetloop(void *data)
+{
+    struct fleetcommand *shared = data;
+    struct command command;
+    size_t msgsize = 1000;
+    char msgbuf[msgsize];
+    char cmdbuf[100];
+    int cmdlen;
+    struct timespec now;
+    int sock, i;
+
+    sock = mksocket();
+    if (!sock)
+        return NULL;
+
+    // Spread the first polls over one period so the landers don't all reply at once
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < fleetsize; i++)
+    {
+        fleet[i].phase = Idle;
+        fleet[i].deadline = now;
+        addns(&fleet[i].deadline, FLEETPERIOD * i / fleetsize);
+    }
+
+    while (true)
+    {
+        long wait = FLEETPERIOD;
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+
+        sem_wait(shared->lock);
+        command = *shared->command;
+        sem_post(shared->lock);
+        cmdlen = formatcommand(cmdbuf, sizeof(cmdbuf), &command);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (i = 0; i < fleetsize; i++)
+        {
+            struct landerctx *c = &fleet[i];
+            long due = diffns(&c->deadline, &now);
+
+            if (due <= 0)
+            {
+                if (c->phase != Idle)
+                    c->timeouts++; /* give up on this cycle */
+                if (c->phase == Idle || diffns(&now, &c->cycle) >= FLEETPERIOD)
+                {
+                    c->cycle = now;
+                    sendto_lander(sock, c, conditionq, strlen(conditionq));
+                    c->phase = AwaitCondition;
+                    c->deadline = now;
+                    addns(&c->deadline, FLEETTIMEOUT);
+                }
+                else
+                {
+                    c->phase = Idle;
+                    c->deadline = c->cycle;
+                    addns(&c->deadline, FLEETPERIOD);
+                }
+                due = diffns(&c->deadline, &now);
+            }
+            if (due < wait)
+                wait = due;
+        }
+
+        if (poll(&pfd, 1, (wait + 999999L) / 1000000L) <= 0)
+            continue;
+
+        // Drain every reply that has arrived
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (true)
+        {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            struct landerctx *c;
+            ssize_t m = recvfrom(sock, msgbuf, msgsize - 1, MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &fromlen);
+            if (m < 0)
+                break;
+            msgbuf[m] = '\0';
+
+            if ((c = lookup(&from)) != NULL)
+                advance(sock, c, msgbuf, cmdbuf, cmdlen, &now);
+        }
+    }
+}
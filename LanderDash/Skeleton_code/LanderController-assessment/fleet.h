@@ -0,0 +1,60 @@
+/* Lander Fleet
+ * KV5002
+ *
+ * Controls many landers from one thread.  Every lander has its own
+ * context; they all share one UDP socket and a single poll(2) loop
+ * drives each lander's condition/state/command cycle from deadlines.
+ */
+#ifndef _FLEET_H
+#define _FLEET_H
+
+#include <time.h>
+#include <semaphore.h>
+#include <netinet/in.h>
+
+#include "lander.h"
+
+#define MAXFLEET 1024
+#define FLEETPERIOD 150000000L /* ns between polls of one lander */
+#define FLEETTIMEOUT 100000000L /* ns to wait for a reply */
+
+enum fleetphase
+{
+    Idle,
+    AwaitCondition,
+    AwaitState,
+    AwaitCommand
+};
+
+struct landerctx
+{
+    char name[64]; /* host:port */
+    struct sockaddr_in addr;
+    enum fleetphase phase;
+    struct timespec deadline; /* next poll when Idle, reply timeout otherwise */
+    struct timespec cycle;    /* when the current cycle started */
+    struct condition cond;
+    struct state state;
+    unsigned long cycles, timeouts;
+    unsigned long stale; /* replies not for the message awaited */
+};
+
+/* The command sent to every lander, copied under lock each pass */
+struct fleetcommand
+{
+    const struct command *command;
+    sem_t *lock;
+};
+
+extern struct landerctx fleet[MAXFLEET];
+extern int fleetsize;
+extern sem_t fleetlock; /* held while a lander context is updated */
+
+/* Adds the landers in a comma separated host:port list, or one per line
+   from a file if the list is @filename.  Returns the number added. */
+int fleetload(const char *list);
+
+/* Thread function, data -> a struct fleetcommand */
+void *fleetloop(void *data);
+
+#endif
@@ -0,0 +1,377 @@
+/* Flight Log
+ * KV5002
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "flightlog.h"
+
+/* ---- CRC-32 (the zlib/ethernet one), a byte at a time from a table ---- */
+
+static uint32_t crctable[256];
+
+static void crcinit(void)
+{
+    uint32_t c;
+    int n, k;
+
+    if (crctable[1])
+        return;
+    for (n = 0; n < 256; n++)
+    {
+        c = n;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crctable[n] = c;
+    }
+}
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t c = 0xffffffffu;
+
+    while (len--)
+        c = crctable[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+static int64_t elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - since->tv_sec) * 1000000000L + (now.tv_nsec - since->tv_nsec);
+}
+
+/* ---- Writing ---- */
+
+// Makes sure a new segment's directory entry survives a crash
+static void syncdir(const char *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Creates the next free segment of the session and writes its header
+static int startsegment(struct flightlog *log)
+{
+    struct flightlog_header h;
+    struct timespec now;
+    char path[sizeof(log->dir) + 64];
+
+    while (true)
+    {
+        snprintf(path, sizeof(path), "%s/flight-%s-%04u.log", log->dir, log->session, log->segment);
+        log->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (log->fd != -1)
+            break;
+        if (errno != EEXIST)
+        {
+            fprintf(stderr, "Cannot create log segment %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        log->segment++; /* another session started in the same second */
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&h, 0, sizeof(h));
+    h.magic = FLIGHTLOG_MAGIC;
+    h.version = FLIGHTLOG_VERSION;
+    h.size = sizeof(h);
+    h.segment = log->segment;
+    h.created = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    memcpy(h.session, log->session, sizeof(h.session));
+
+    if (write(log->fd, &h, sizeof(h)) != sizeof(h))
+    {
+        fprintf(stderr, "Cannot write log segment %s: %s\n", path, strerror(errno));
+        close(log->fd);
+        unlink(path);
+        log->fd = -1;
+        return false;
+    }
+    fdatasync(log->fd);
+    syncdir(log->dir);
+
+    log->size = sizeof(h);
+    clock_gettime(CLOCK_MONOTONIC, &log->opened);
+    log->synced = log->opened;
+    log->dirty = false;
+    return true;
+}
+
+static void endsegment(struct flightlog *log)
+{
+    if (log->fd == -1)
+        return;
+    if (log->dirty)
+        fdatasync(log->fd);
+    close(log->fd);
+    log->fd = -1;
+}
+
+// The file name of the directory's newest segment, false if there is none
+static int newestsegment(const char *dir, char *name, size_t size)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    size_t n;
+
+    name[0] = '\0';
+    if (d == NULL)
+        return false;
+    while ((e = readdir(d)) != NULL)
+    {
+        n = strlen(e->d_name);
+        if (strncmp(e->d_name, "flight-", 7) == 0 && n > 4 && strcmp(e->d_name + n - 4, ".log") == 0 &&
+            strcmp(e->d_name, name) > 0 && n < size)
+            strcpy(name, e->d_name); /* the names sort by session, then segment */
+    }
+    closedir(d);
+    return name[0] != '\0';
+}
+
+int flightlog_open(struct flightlog *log, const char *dir, off_t maxsize,
+                   int64_t maxage, int64_t syncinterval)
+{
+    char name[256];
+    char path[sizeof(log->dir) + sizeof(name) + 1];
+    time_t now;
+
+    crcinit();
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    log->maxsize = maxsize;
+    log->maxage = maxage;
+    log->syncinterval = syncinterval;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Cannot make log directory %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    // Only the last segment written can have been torn
+    if (newestsegment(dir, name, sizeof(name)))
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        log->recovered = flightlog_recover(path);
+        if (log->recovered > 0)
+            fprintf(stderr, "Cut %ld torn bytes off %s\n", (long)log->recovered, path);
+    }
+
+    time(&now);
+    strftime(log->session, sizeof(log->session), "%Y%m%d-%H%M%S", localtime(&now));
+    return startsegment(log);
+}
+
+int flightlog_append(struct flightlog *log, const void *data, size_t len)
+{
+    uint32_t frame[2];
+    struct iovec iov[2];
+    ssize_t n;
+
+    if (len > FLIGHTLOG_MAXRECORD)
+        return false;
+
+    // Move on to the next segment when this one is full or old enough
+    if (log->fd != -1 && log->size > sizeof(struct flightlog_header) &&
+        ((log->maxsize && log->size + sizeof(frame) + len > log->maxsize) ||
+         (log->maxage && elapsed(&log->opened) >= log->maxage)))
+    {
+        endsegment(log);
+        log->segment++;
+    }
+    if (log->fd == -1 && !startsegment(log))
+        return false;
+
+    frame[0] = len;
+    frame[1] = crc32(data, len);
+    iov[0].iov_base = frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    n = writev(log->fd, iov, 2);
+    if (n != sizeof(frame) + len)
+    {
+        if (n > 0 && ftruncate(log->fd, log->size) == -1)
+            fprintf(stderr, "Cannot undo a short log write: %s\n", strerror(errno));
+        return false;
+    }
+    log->size += n;
+    log->records++;
+    log->dirty = true;
+    flightlog_tick(log);
+    return true;
+}
+
+void flightlog_tick(struct flightlog *log)
+{
+    if (log->fd == -1 || !log->dirty || elapsed(&log->synced) < log->syncinterval)
+        return;
+    fdatasync(log->fd);
+    clock_gettime(CLOCK_MONOTONIC, &log->synced);
+    log->dirty = false;
+}
+
+void flightlog_close(struct flightlog *log)
+{
+    endsegment(log);
+}
+
+/* ---- Recovery ---- */
+
+// Checks the header, returns false if it isn't a segment's
+static int validheader(const struct flightlog_header *h)
+{
+    return h->magic == FLIGHTLOG_MAGIC && h->version == FLIGHTLOG_VERSION &&
+           h->size == sizeof(*h);
+}
+
+off_t flightlog_recover(const char *path)
+{
+    struct stat st;
+    const char *map;
+    off_t at, end;
+    uint32_t frame[2];
+    int fd;
+
+    crcinit();
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "Cannot open log segment %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(struct flightlog_header))
+    {
+        close(fd);
+        unlink(path); /* died before the header was down */
+        return st.st_size;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map log segment %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!validheader((const struct flightlog_header *)map))
+    {
+        fprintf(stderr, "%s is not a log segment\n", path);
+        munmap((void *)map, st.st_size);
+        close(fd);
+        return -1;
+    }
+
+    // Walk the frames to the first one that is short or fails its check
+    end = st.st_size;
+    at = sizeof(struct flightlog_header);
+    while (end - at >= sizeof(frame))
+    {
+        memcpy(frame, map + at, sizeof(frame));
+        if (frame[0] > FLIGHTLOG_MAXRECORD || frame[0] > end - at - sizeof(frame) ||
+            crc32(map + at + sizeof(frame), frame[0]) != frame[1])
+            break;
+        at += sizeof(frame) + frame[0];
+    }
+    munmap((void *)map, st.st_size);
+
+    if (at < end && (ftruncate(fd, at) == -1 || fdatasync(fd) == -1))
+    {
+        fprintf(stderr, "Cannot truncate log segment %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return end - at;
+}
+
+/* ---- Reading ---- */
+
+int flightlog_openread(struct flightlog_reader *r, const char *path)
+{
+    crcinit();
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd == -1)
+    {
+        fprintf(stderr, "Cannot open log segment %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (read(r->fd, &r->header, sizeof(r->header)) != sizeof(r->header) ||
+        !validheader(&r->header))
+    {
+        fprintf(stderr, "%s is not a log segment\n", path);
+        close(r->fd);
+        r->fd = -1;
+        return false;
+    }
+    r->offset = sizeof(r->header);
+    return true;
+}
+
+ssize_t flightlog_next(struct flightlog_reader *r, void *buffer, size_t size)
+{
+    uint32_t frame[2];
+
+    if (pread(r->fd, frame, sizeof(frame), r->offset) != sizeof(frame) ||
+        frame[0] > FLIGHTLOG_MAXRECORD || frame[0] > size ||
+        pread(r->fd, buffer, frame[0], r->offset + sizeof(frame)) != frame[0] ||
+        crc32(buffer, frame[0]) != frame[1])
+        return -1;
+    r->offset += sizeof(frame) + frame[0];
+    return frame[0];
+}
+
+void flightlog_closeread(struct flightlog_reader *r)
+{
+    if (r->fd != -1)
+        close(r->fd);
+    r->fd = -1;
+}
+
+/* ---- Controller records ---- */
+
+/* The times and key as they are in the structure, then the telemetry */
+#define RECORDHEAD offsetof(struct flightrecord, t)
+
+size_t flightrecord_pack(void *buffer, size_t size, const struct flightrecord *rec)
+{
+    char *p = buffer;
+
+    if (size < RECORDHEAD)
+        return 0;
+    memcpy(p, rec, RECORDHEAD);
+    size = telemetry_encode(p + RECORDHEAD, size - RECORDHEAD, &rec->t, F_ALL);
+    return size ? RECORDHEAD + size : 0;
+}
+
+int flightrecord_unpack(const void *buffer, size_t len, struct flightrecord *rec)
+{
+    const char *p = buffer;
+
+    if (len < RECORDHEAD)
+        return false;
+    memset(rec, 0, sizeof(*rec));
+    memcpy(rec, p, RECORDHEAD);
+    rec->key[sizeof(rec->key) - 1] = '\0';
+    return telemetry_decode(p + RECORDHEAD, len - RECORDHEAD, &rec->t) != 0;
+}
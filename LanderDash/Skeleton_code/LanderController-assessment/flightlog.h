@@ -0,0 +1,115 @@
+/* Flight Log
+ * KV5002
+ *
+ * An append-only log kept as numbered segment files in a directory, with
+ * a new series every session so no flight overwrites another:
+ *
+ *     dir/flight-YYYYMMDD-HHMMSS-NNNN.log
+ *
+ * A segment is a fixed header followed by framed records
+ *
+ *     uint32 length, uint32 crc32 of the payload, payload
+ *
+ * each written to an O_APPEND descriptor in one write, so a crash can tear
+ * the last record of the last segment and nothing else.  Opening the log
+ * checks the newest segment already in the directory and cuts any torn
+ * record off its end.  A segment is finished and the next begun when it
+ * reaches its size or age limit, and data is synced at most once per sync
+ * interval rather than for every record.
+ */
+#ifndef _FLIGHTLOG_H
+#define _FLIGHTLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "telemetry.h"
+
+#define FLIGHTLOG_MAGIC 0x474f4c46u /* "FLOG" */
+#define FLIGHTLOG_VERSION 2        /* 2: records carry wall and monotonic times */
+#define FLIGHTLOG_MAXRECORD 4096    /* payload bytes, anything longer is corrupt */
+
+/* Host byte order, like the records */
+struct flightlog_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;    /* sizeof(struct flightlog_header) */
+    uint32_t segment; /* NNNN in the file name */
+    int64_t created;  /* CLOCK_REALTIME, nanoseconds */
+    char session[16]; /* YYYYMMDD-HHMMSS */
+};
+
+struct flightlog
+{
+    char dir[256];
+    char session[16];
+    int fd;                   /* current segment, -1 if none */
+    unsigned segment;
+    off_t size;               /* of the current segment */
+    struct timespec opened;   /* CLOCK_MONOTONIC, current segment */
+    struct timespec synced;   /* last fdatasync */
+    int dirty;                /* written since then */
+    off_t maxsize;            /* limits per segment, 0 for none */
+    int64_t maxage;           /* ns */
+    int64_t syncinterval;     /* ns */
+    unsigned long records;    /* appended this session */
+    off_t recovered;          /* torn bytes cut off the last session's log */
+};
+
+/* Recovers the directory's newest segment and starts this session's first,
+   making the directory if need be; returns false on failure */
+int flightlog_open(struct flightlog *log, const char *dir, off_t maxsize,
+                   int64_t maxage, int64_t syncinterval);
+
+/* Appends one record, returns false on failure (the log is left as it was) */
+int flightlog_append(struct flightlog *log, const void *data, size_t len);
+
+/* Syncs if the sync interval has passed since the last sync */
+void flightlog_tick(struct flightlog *log);
+
+void flightlog_close(struct flightlog *log);
+
+/* Checks a segment and truncates it after its last whole record, removing
+   it if not even the header survived; returns the bytes cut off or -1 */
+off_t flightlog_recover(const char *path);
+
+/* ---- Reading ---- */
+
+struct flightlog_reader
+{
+    int fd;
+    off_t offset;
+    struct flightlog_header header;
+};
+
+/* Opens a segment for reading, returns false if it isn't one */
+int flightlog_openread(struct flightlog_reader *r, const char *path);
+
+/* Copies the next record's payload, returns its length or -1 at the end
+   (or at a torn or corrupt record) */
+ssize_t flightlog_next(struct flightlog_reader *r, void *buffer, size_t size);
+
+void flightlog_closeread(struct flightlog_reader *r);
+
+/* ---- Controller records ----
+
+    One sample: when it arrived, the last key and every telemetry field
+*/
+struct flightrecord
+{
+    int64_t wall; /* CLOCK_REALTIME, nanoseconds */
+    int64_t mono; /* CLOCK_MONOTONIC, the same moment */
+    char key[8];
+    struct telemetry t;
+};
+
+/* Packs a record for flightlog_append(), returns its length, 0 if it won't fit */
+size_t flightrecord_pack(void *buffer, size_t size, const struct flightrecord *rec);
+
+/* Unpacks a payload, returns false if it isn't a record */
+int flightrecord_unpack(const void *buffer, size_t len, struct flightrecord *rec);
+
+#endif
@@ -0,0 +1,158 @@
+/* Telemetry History
+ * KV5002
+ */
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <time.h>
+
+#include <semaphore.h>
+
+#include "history.h"
+
+#define MASK (HISTORYSIZE - 1)
+#define LANES 8 /* independent accumulators, one per vector lane */
+
+void history_init(struct history *h)
+{
+    memset(h, 0, sizeof(*h));
+    sem_init(&h->lock, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &h->origin);
+}
+
+void history_add(struct history *h, const struct timespec *when,
+                 const struct command *cmd, const struct state *st,
+                 const struct condition *cond)
+{
+    struct telemetry t;
+    unsigned i;
+
+    telemetry_gather(&t, cmd, st, cond);
+
+    sem_wait(&h->lock); /* Enter critical section */
+    i = h->count & MASK;
+    h->t[i] = (when->tv_sec - h->origin.tv_sec) + (when->tv_nsec - h->origin.tv_nsec) * 1e-9;
+#define STORE(NAME, member, key, wire, type) h->v[H_##NAME][i] = t.member;
+    TELEMETRY_FIELDS(STORE)
+    h->count++;
+    sem_post(&h->lock); /* Exit critical section */
+}
+
+/* Running sums for a window, kept per lane so that every lane's work is
+   independent and the loop below becomes vector instructions without
+   having to relax floating point ordering */
+struct sums
+{
+    float lo[LANES], hi[LANES];
+    float s[LANES], st[LANES], stt[LANES], sv[LANES];
+};
+
+// Accumulates n samples from one contiguous run of the ring, times relative to t0
+static void accumulate(struct sums *a, const float *restrict t, const float *restrict v,
+                       int n, float t0)
+{
+    struct sums l = *a; /* locals can't alias t or v */
+    int i, j;
+
+    for (i = 0; i + LANES <= n; i += LANES)
+        for (j = 0; j < LANES; j++)
+        {
+            float x = v[i + j], dt = t[i + j] - t0;
+            l.lo[j] = x < l.lo[j] ? x : l.lo[j];
+            l.hi[j] = x > l.hi[j] ? x : l.hi[j];
+            l.s[j] += x;
+            l.st[j] += dt;
+            l.stt[j] += dt * dt;
+            l.sv[j] += dt * x;
+        }
+    for (j = 0; i < n; i++, j++) /* the leftovers, at most LANES - 1 */
+    {
+        float x = v[i], dt = t[i] - t0;
+        l.lo[j] = x < l.lo[j] ? x : l.lo[j];
+        l.hi[j] = x > l.hi[j] ? x : l.hi[j];
+        l.s[j] += x;
+        l.st[j] += dt;
+        l.stt[j] += dt * dt;
+        l.sv[j] += dt * x;
+    }
+    *a = l;
+}
+
+int history_trend(struct history *h, enum historyfield f, float window,
+                  struct trend *out)
+{
+    struct sums a;
+    unsigned long count;
+    unsigned first, last;
+    int n, lo, hi, j;
+    float tlast, t0, s = 0, st = 0, stt = 0, sv = 0, d;
+
+    memset(out, 0, sizeof(*out));
+
+    sem_wait(&h->lock); /* Enter critical section */
+
+    count = h->count < HISTORYSIZE ? h->count : HISTORYSIZE;
+    if (count == 0)
+    {
+        sem_post(&h->lock);
+        return 0;
+    }
+    last = (h->count - 1) & MASK;
+    tlast = h->t[last];
+
+    /* binary search for the oldest sample inside the window, the ring
+       is in time order counting back from the newest */
+    lo = 0;
+    hi = count - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (tlast - h->t[(h->count - 1 - mid) & MASK] <= window)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    n = lo + 1;
+    first = (h->count - n) & MASK;
+    t0 = h->t[first];
+
+    for (j = 0; j < LANES; j++)
+    {
+        a.lo[j] = FLT_MAX;
+        a.hi[j] = -FLT_MAX;
+        a.s[j] = a.st[j] = a.stt[j] = a.sv[j] = 0;
+    }
+
+    /* the window is at most two contiguous runs, before and after the wrap */
+    if (first + n <= HISTORYSIZE)
+        accumulate(&a, &h->t[first], &h->v[f][first], n, t0);
+    else
+    {
+        accumulate(&a, &h->t[first], &h->v[f][first], HISTORYSIZE - first, t0);
+        accumulate(&a, h->t, h->v[f], n - (HISTORYSIZE - first), t0);
+    }
+
+    sem_post(&h->lock); /* Exit critical section */
+
+    out->n = n;
+    out->min = FLT_MAX;
+    out->max = -FLT_MAX;
+    for (j = 0; j < LANES; j++)
+    {
+        if (a.lo[j] < out->min)
+            out->min = a.lo[j];
+        if (a.hi[j] > out->max)
+            out->max = a.hi[j];
+        s += a.s[j];
+        st += a.st[j];
+        stt += a.stt[j];
+        sv += a.sv[j];
+    }
+    out->mean = s / n;
+    out->span = tlast - t0;
+
+    d = n * stt - st * st;
+    if (n > 1 && d > 0)
+        out->rate = (n * sv - st * s) / d;
+    return n;
+}
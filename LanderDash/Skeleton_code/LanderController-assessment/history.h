@@ -0,0 +1,57 @@
+/* Telemetry History
+ * KV5002
+ *
+ * A fixed ring of the most recent samples, kept structure-of-arrays:
+ * one float array per field plus the sample times, so a query over a
+ * window runs down contiguous memory and the compiler can vectorise it.
+ * One thread adds samples, any number may query.
+ */
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <time.h>
+#include <semaphore.h>
+
+#include "lander.h"
+
+#define HISTORYSIZE 1024 /* samples kept, a power of two (51 s at 20 Hz) */
+
+/* A column for every telemetry field: H_FUEL, H_ALTITUDE... */
+#define HISTORY_COLUMN(NAME, member, key, wire, type) H_##NAME,
+enum historyfield
+{
+    TELEMETRY_FIELDS(HISTORY_COLUMN)
+    HFIELDS
+};
+
+struct history
+{
+    sem_t lock;
+    struct timespec origin;          /* times are seconds since here */
+    unsigned long count;             /* samples ever added */
+    float t[HISTORYSIZE];
+    float v[HFIELDS][HISTORYSIZE];
+};
+
+/* Aggregates of one field over a window */
+struct trend
+{
+    int n;           /* samples in the window, the rest is 0 if none */
+    float min, max, mean;
+    float rate;      /* least squares slope, per second */
+    float span;      /* seconds between the first and last sample */
+};
+
+void history_init(struct history *h);
+
+/* Record the sample taken at when */
+void history_add(struct history *h, const struct timespec *when,
+                 const struct command *cmd, const struct state *st,
+                 const struct condition *cond);
+
+/* Aggregates of a field over the last window seconds of samples,
+   returns the number of samples used */
+int history_trend(struct history *h, enum historyfield f, float window,
+                  struct trend *out);
+
+#endif
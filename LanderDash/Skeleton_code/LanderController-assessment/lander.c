@@ -0,0 +1,139 @@
+/* Lander Protocol
+ * KV5002
+ */
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include <semaphore.h>
+
+#include "lander.h"
+
+const char conditionq[] = "condition:?\n";
+const char stateq[] = "state:?\n";
+
+static const char *contactnames[] = {"flying", "down", "crashed"};
+
+const char *contactname(int contact)
+{
+    return contact >= Flying && contact <= Crashed ? contactnames[contact] : "unknown";
+}
+
+// --- Parse a value of each field type ---
+static void parse_FLOAT(const char *value, float *v)
+{
+    sscanf(value, "%f", v);
+}
+
+static void parse_PERCENT(const char *value, float *v)
+{
+    sscanf(value, "%f%%", v);
+}
+
+static void parse_CONTACT(const char *value, int *v)
+{
+    int c;
+    for (c = Flying; c <= Crashed; c++)
+        if (strcmp(value, contactnames[c]) == 0)
+            *v = c;
+}
+
+// --- Store one key:value in its field, the dispatch comes from the schema ---
+#define PARSEFIELD(NAME, member, key, wire, type) \
+    if (strcmp(k, wire) == 0)                      \
+    {                                              \
+        parse_##type(v, &out->member);             \
+        return;                                    \
+    }
+
+static void conditionfield(void *data, const char *k, const char *v)
+{
+    struct condition *out = data;
+    CONDITION_FIELDS(PARSEFIELD)
+}
+
+static void statefield(void *data, const char *k, const char *v)
+{
+    struct state *out = data;
+    STATE_FIELDS(PARSEFIELD)
+}
+
+// Splits a message into key:value lines and hands each to field()
+static void parselines(char *m, void (*field)(void *, const char *, const char *),
+                       void *out, sem_t *lock)
+{
+    char *line;
+    char *rest;
+    for (/* split into lines lecture 07-2 slide 21 */
+         line = strtok_r(m, "\r\n", &rest);
+         line != NULL;
+         line = strtok_r(NULL, "\r\n", &rest))
+    {
+        char *key, *value, *r;
+        key = strtok_r(line, ":", &r);
+        value = strtok_r(NULL, ":", &r);
+        if (key == NULL || value == NULL)
+            continue;
+
+        if (lock)
+            sem_wait(lock); /* Enter critical section */
+        field(out, key, value);
+        if (lock)
+            sem_post(lock); /* Exit critical section */
+    }
+}
+
+// --- Parse condition reply message --
+void parsecondition(char *m, struct condition *cond, sem_t *lock)
+{
+    parselines(m, conditionfield, cond, lock);
+}
+
+// --- Parse state message ---
+void parsestate(char *m, struct state *st, sem_t *lock)
+{
+    parselines(m, statefield, st, lock);
+}
+
+// --- Format command message ---
+int formatcommand(char *buffer, size_t size, const struct command *cmd)
+{
+    int len = snprintf(buffer, size, "command:!\n");
+#define COMMANDFIELD(NAME, member, key, wire, type) \
+    if (len < size)                                  \
+        len += snprintf(buffer + len, size - len, wire ": %f\n", cmd->member);
+    COMMAND_FIELDS(COMMANDFIELD)
+    return len;
+}
+
+/* --- Poll rate for the flight phase ---
+
+    Once down or crashed nothing changes, so poll at the minimum rate.
+    While flying, aim for TOUCHDOWNSAMPLES polls between now and touchdown
+    at the current descent speed, so the rate climbs as the lander falls
+    faster and gets lower, within minrate..maxrate.
+*/
+#define TOUCHDOWNSAMPLES 50
+#define LOWALTITUDE 20.0 /* always poll at the maximum rate below this */
+
+float pollrate(const struct condition *cond, const struct state *st,
+               float minrate, float maxrate)
+{
+    float descent, rate;
+
+    if (cond->contact != Flying)
+        return minrate;
+    if (cond->altitude < LOWALTITUDE)
+        return maxrate;
+
+    descent = fabsf(st->dy);
+    if (descent < 0.01)
+        return minrate;
+
+    rate = TOUCHDOWNSAMPLES * descent / cond->altitude; /* samples / time to touchdown */
+    if (rate < minrate)
+        rate = minrate;
+    if (rate > maxrate)
+        rate = maxrate;
+    return rate;
+}
@@ -0,0 +1,53 @@
+/* Lander Protocol
+ * KV5002
+ *
+ * Message structures and the parsers/formatters for talking to the lander
+ */
+#ifndef _LANDER_H
+#define _LANDER_H
+
+#include <stddef.h>
+#include <semaphore.h>
+
+#include "telemetry.h"
+
+/* The members come from the field lists in telemetry.h */
+struct command
+{
+    COMMAND_FIELDS(TELEMETRY_MEMBER)
+};
+
+struct state
+{
+    STATE_FIELDS(TELEMETRY_MEMBER)
+};
+
+enum condstate
+{
+    Flying,
+    Down,
+    Crashed
+};
+struct condition
+{
+    CONDITION_FIELDS(TELEMETRY_MEMBER)
+};
+
+extern const char conditionq[];
+extern const char stateq[];
+
+/* "flying", "down" or "crashed" */
+const char *contactname(int contact);
+
+/* Parse a reply into the structure, holding lock (if not NULL) while updating */
+void parsecondition(char *m, struct condition *cond, sem_t *lock);
+void parsestate(char *m, struct state *st, sem_t *lock);
+
+/* Format a command message, returns its length */
+int formatcommand(char *buffer, size_t size, const struct command *cmd);
+
+/* How often (Hz) to poll the lander in its current flight phase */
+float pollrate(const struct condition *cond, const struct state *st,
+               float minrate, float maxrate);
+
+#endif
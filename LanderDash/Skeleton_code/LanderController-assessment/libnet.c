@@ -1,17 +1,32 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
 
 #include <errno.h>
 #include <string.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#include "libnet.h"
+
 // Gets address info
 // Returns false if address info not found
 int getaddr(const char *node, const char *service,
@@ -66,39 +81,72 @@ int bindsocket(int sfd, const struct sockaddr *addr, socklen_t addrlen)
 }
 
 // Converts data from addr to URI host:port notation
-char uri[80];
+char uri[128];
 char *addrtouri(struct sockaddr *addr)
 {
     struct sockaddr_in *a = (struct sockaddr_in *)addr;
+    if (addr->sa_family == AF_UNIX)
+    {
+        struct sockaddr_un *u = (struct sockaddr_un *)addr;
+        snprintf(uri, sizeof(uri), "unix:%s", u->sun_path[0] ? u->sun_path : "(unnamed)");
+        return uri;
+    }
     sprintf(uri, "%s:%d", inet_ntoa(a->sin_addr), ntohs(a->sin_port));
     return uri;
 }
 
-typedef size_t (*handler_t)(
-    char *,
-    size_t,
-    char *, size_t,
-    struct sockaddr_in *);
+// Creates a Unix domain datagram socket, bound to path if it is not NULL
+// Returns false on failure, as mksocket() does
+int mkunixsocket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    socklen_t addrlen = sizeof(sa_family_t); /* unnamed: the kernel picks one */
+    int socketfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    if (socketfd == -1)
+    {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return 0;
+    }
+
+    if (path)
+    {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        addrlen = sizeof(addr);
+        unlink(path); /* left over from a previous run */
+    }
+    if (!bindsocket(socketfd, (struct sockaddr *)&addr, addrlen))
+    {
+        close(socketfd);
+        return 0;
+    }
+    return socketfd;
+}
 
 // Handles the server
 int server(int srvrsock, handler_t handlemsg)
 {
     const size_t buffsize = 4096; /* 4k */
     char message[buffsize], reply[buffsize];
-    size_t msgsize, replysize;
-    struct sockaddr clientaddr;
-    socklen_t addrlen = sizeof(clientaddr);
+    ssize_t msgsize;
+    size_t replysize;
+    struct sockaddr_storage clientaddr; /* big enough for unix: addresses too */
+    socklen_t addrlen;
 
     while (true)
     {
+        addrlen = sizeof(clientaddr);
+
         // Receive message through socket
         msgsize = recvfrom(
             srvrsock,    /* server socket listening on */
             message,     /* buffer to put message */
             buffsize,    /* size of receiving buffer */
             0,           /* flags */
-            &clientaddr, /* fill in with address of client */
-            &addrlen);   /* number of bytes filled in */
+            (struct sockaddr *)&clientaddr, /* fill in with address of client */
+            &addrlen);                      /* number of bytes filled in */
+        if (msgsize == -1)
+            continue;
 
         replysize = handlemsg(
             message,  /* incoming message */
@@ -115,12 +163,40 @@ int server(int srvrsock, handler_t handlemsg)
                 reply,       /* outgoing message to send */
                 replysize,   /* size of message */
                 0,           /* flags */
-                &clientaddr, /* address to send to */
-                addrlen);    /* size of address structure */
+                (struct sockaddr *)&clientaddr, /* address to send to */
+                addrlen);                       /* size of address structure */
         }
     }
 }
 
+// Handles every message already waiting, without blocking; returns how many
+int serverready(int srvrsock, handler_t handlemsg)
+{
+    const size_t buffsize = 4096;
+    char message[buffsize], reply[buffsize];
+    struct sockaddr_storage clientaddr;
+    socklen_t addrlen;
+    ssize_t msgsize;
+    size_t replysize;
+    int handled = 0;
+
+    while (true)
+    {
+        addrlen = sizeof(clientaddr);
+        msgsize = recvfrom(srvrsock, message, buffsize, MSG_DONTWAIT,
+                           (struct sockaddr *)&clientaddr, &addrlen);
+        if (msgsize == -1)
+            return handled; /* EAGAIN: nothing more for now */
+
+        replysize = handlemsg(message, msgsize, reply, buffsize,
+                              (struct sockaddr_in *)&clientaddr);
+        if (replysize)
+            sendto(srvrsock, reply, replysize, MSG_DONTWAIT,
+                   (struct sockaddr *)&clientaddr, addrlen);
+        handled++;
+    }
+}
+
 void finished(int signal)
 {
     exit(0);
@@ -132,4 +208,911 @@ int cleanupsock;
 void cleanup(void)
 {
     close(cleanupsock);
-}
\ No newline at end of file
+}
+
+/* -------------------- Connections -------------------- */
+
+#define RECONNECTDELAY 1 /* seconds between attempts to reopen a stream */
+#define CONNECTTIMEOUT 1000 /* ms, a stream connect's limit until netrequest() sets one */
+#ifdef EMBEDDED
+#define MAXFRAME 4096    /* largest message accepted on a stream */
+#define MAXSTREAMS 8     /* stream connections open at once */
+#else
+#define MAXFRAME 65536
+#endif
+
+#ifdef EMBEDDED
+/* Stream receive buffers from a fixed pool rather than the heap */
+static char rxpool[MAXSTREAMS][MAXFRAME + sizeof(uint32_t)];
+static char *rxtaken[MAXSTREAMS];
+
+static char *rxalloc(void)
+{
+    int i;
+    for (i = 0; i < MAXSTREAMS; i++)
+        if (__atomic_exchange_n(&rxtaken[i], rxpool[i], __ATOMIC_ACQUIRE) == NULL)
+            return rxpool[i];
+    fprintf(stderr, "More than %d stream connections\n", MAXSTREAMS);
+    return NULL;
+}
+
+static void rxfree(char *buf)
+{
+    if (buf)
+        __atomic_store_n(&rxtaken[(buf - rxpool[0]) / sizeof(rxpool[0])], NULL, __ATOMIC_RELEASE);
+}
+#else
+#define rxalloc() malloc(MAXFRAME + sizeof(uint32_t))
+#define rxfree free
+#endif
+
+// Creates a TCP socket with Nagle's algorithm off, so small messages go at once
+int mkstreamsocket(void)
+{
+    int one = 1;
+    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (socketfd == -1)
+    {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return 0;
+    }
+    setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    return socketfd;
+}
+
+/* Sends one framed message, in a single system call where the stream allows
+
+    On a non-blocking stream a full send buffer fails with EAGAIN if none
+    of the frame went, so the stream is still in step and can be used
+    again, or EPIPE if part of it did, and the stream must be dropped.
+*/
+static ssize_t sendframe(int fd, enum framing framing, const char *msg, size_t len)
+{
+    uint32_t prefix = htonl(len);
+    struct iovec iov[2];
+    struct msghdr mh = {.msg_iov = iov, .msg_iovlen = 2};
+    size_t total, whole;
+
+    if (framing == FRAME_LENGTH)
+    {
+        iov[0] = (struct iovec){.iov_base = &prefix, .iov_len = sizeof(prefix)};
+        iov[1] = (struct iovec){.iov_base = (char *)msg, .iov_len = len};
+    }
+    else
+    {
+        iov[0] = (struct iovec){.iov_base = (char *)msg, .iov_len = len};
+        iov[1] = (struct iovec){.iov_base = "\n", .iov_len = 1};
+    }
+    total = whole = iov[0].iov_len + iov[1].iov_len;
+
+    while (total > 0)
+    {
+        ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && total < whole)
+                errno = EPIPE;
+            return -1;
+        }
+        total -= sent;
+
+        // Skip over whatever was sent, a stream may take a partial write
+        while (mh.msg_iovlen && (size_t)sent >= mh.msg_iov->iov_len)
+        {
+            sent -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen)
+        {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + sent;
+            mh.msg_iov->iov_len -= sent;
+        }
+    }
+    return len;
+}
+
+/* Takes one complete message off the front of a receive buffer
+
+    Returns the length copied into buf, -1 if the message is not all
+    there yet, or -2 if the stream is broken (message too long)
+*/
+static ssize_t takeframe(char *rxbuf, size_t *rxlen, size_t rxsize,
+                         enum framing framing, char *buf, size_t size)
+{
+    size_t start, len, used;
+
+    if (framing == FRAME_LENGTH)
+    {
+        uint32_t prefix;
+        if (*rxlen < sizeof(prefix))
+            return -1;
+        memcpy(&prefix, rxbuf, sizeof(prefix));
+        len = ntohl(prefix);
+        if (len > rxsize - sizeof(prefix))
+            return -2;
+        if (*rxlen < sizeof(prefix) + len)
+            return -1;
+        start = sizeof(prefix);
+        used = start + len;
+    }
+    else
+    {
+        char *end = memmem(rxbuf, *rxlen, "\n\n", 2);
+        if (end == NULL)
+            return *rxlen == rxsize ? -2 : -1;
+        start = 0;
+        len = end - rxbuf + 1; /* keep the message's own newline */
+        used = len + 1;
+    }
+
+    if (len > size)
+        len = size;
+    memcpy(buf, rxbuf + start, len);
+    memmove(rxbuf, rxbuf + used, *rxlen - used);
+    *rxlen -= used;
+    return len;
+}
+
+/* -------------------- Shared memory rings --------------------
+
+    shm:name peers share /dev/shm/name holding one ring per direction.
+    Each ring has a single producer and a single consumer, so the head
+    and tail counters are enough to hand messages over without locks.
+    A consumer that finds its ring empty spins for a while, then sleeps
+    on a futex; the producer only makes the wake-up call when a consumer
+    has said it is waiting.
+*/
+#define SHMSPIN 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpurelax() __builtin_ia32_pause()
+#else
+#define cpurelax()
+#endif
+
+static int futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// Maps the named region, creating it (zeroed, so empty) if need be
+static struct shmlink *shmattach(const char *name)
+{
+    char path[256];
+    struct shmlink *shm;
+    int fd;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(struct shmlink)) == -1)
+    {
+        fprintf(stderr, "Error opening shared memory %s: %s\n", name, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    shm = mmap(NULL, sizeof(struct shmlink), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        fprintf(stderr, "Error mapping shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    return shm;
+}
+
+// Puts a message on a ring, -1 (EAGAIN) if full: like UDP it is dropped
+static ssize_t ringput(struct shmring *r, const char *msg, size_t len)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == SHMSLOTS)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > SHMSLOTSIZE)
+        len = SHMSLOTSIZE;
+    memcpy(r->slots[head % SHMSLOTS], msg, len);
+    r->lengths[head % SHMSLOTS] = len;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST))
+        futex(&r->head, FUTEX_WAKE, 1, NULL);
+    return len;
+}
+
+// Waits up to timeout ms (-1 for ever) for a message, returns false if none came
+static int ringwait(struct shmring *r, long timeout)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    struct timespec t = {.tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000};
+    int spin = 0;
+
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+    {
+        if (spin++ < SHMSPIN)
+        {
+            cpurelax();
+            continue;
+        }
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail &&
+            futex(&r->head, FUTEX_WAIT, tail, timeout < 0 ? NULL : &t) == -1 &&
+            errno == ETIMEDOUT)
+            return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail;
+    }
+    return true;
+}
+
+// Takes the next message off a ring, waiting for one if it is empty
+static ssize_t ringget(struct shmring *r, char *buf, size_t size)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    size_t len;
+
+    ringwait(r, -1);
+
+    len = r->lengths[tail % SHMSLOTS];
+    if (len > size)
+        len = size;
+    memcpy(buf, r->slots[tail % SHMSLOTS], len);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Handles a shared memory server
+
+    Like server() for the one shm:name client.  The handler is given an
+    AF_UNSPEC address.  This function does not return.
+*/
+int shmserver(const char *name, handler_t handlemsg)
+{
+    const size_t buffsize = SHMSLOTSIZE;
+    char message[buffsize], reply[buffsize];
+    struct sockaddr_in nowhere = {.sin_family = AF_UNSPEC};
+    struct shmlink *shm = shmattach(name);
+
+    if (shm == NULL)
+        return false;
+
+    while (true)
+    {
+        ssize_t msgsize = ringget(&shm->rings[0], message, buffsize);
+        size_t replysize = handlemsg(message, msgsize, reply, buffsize, &nowhere);
+        if (replysize)
+            ringput(&shm->rings[1], reply, replysize);
+    }
+}
+
+/* Connects a client stream, waiting no more than connecttimeout for it
+
+    The socket is non-blocking from the start, so an unreachable peer costs
+    the caller connecttimeout, not the kernel's SYN timeout.  A failure is
+    counted in stats rather than printed, as the caller may be drawing the
+    terminal.
+*/
+static int streamopen(struct connection *c)
+{
+    struct pollfd pfd = {.events = POLLOUT};
+    socklen_t errlen = sizeof(int);
+    int fd, n, err = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &c->lastattempt);
+    if (!(fd = mkstreamsocket()))
+        return false;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(fd, (struct sockaddr *)&c->peer, c->peerlen) == -1)
+    {
+        err = errno;
+        if (err == EINPROGRESS)
+        {
+            pfd.fd = fd;
+            while ((n = poll(&pfd, 1, c->connecttimeout)) == -1 && errno == EINTR)
+                ;
+            if (n == 1)
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            else
+                err = ETIMEDOUT;
+        }
+    }
+    if (err)
+    {
+        c->stats.connectfails++;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    c->fd = fd;
+    c->rxlen = 0;
+    return true;
+}
+
+static void streamlost(struct connection *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->rxlen = 0;
+}
+
+// Reopens a lost stream, trying no more than once every RECONNECTDELAY
+static int streamready(struct connection *c)
+{
+    struct timespec now;
+
+    if (c->fd != -1)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - c->lastattempt.tv_sec < RECONNECTDELAY)
+    {
+        errno = ENOTCONN;
+        return false;
+    }
+    if (!streamopen(c))
+        return false;
+    c->reconnects++;
+    return true;
+}
+
+// Has the kernel stamp every datagram with when it arrived, returns fd
+static int timestamped(int fd)
+{
+    int on = 1;
+    if (fd > 0 && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+        fprintf(stderr, "No receive timestamps: %s\n", strerror(errno));
+    return fd;
+}
+
+// Opens a connection to the peer named by address (see libnet.h)
+// A stream that can't connect yet is retried on the first send
+int netconnect(struct connection *c, const char *address, const char *defaulthost)
+{
+    char copy[strlen(address) + 1];
+    char *host, *service;
+    struct addrinfo *addr;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->transport = UDP;
+    c->framing = FRAME_LENGTH;
+
+    strcpy(copy, address);
+    host = copy;
+    if (strncmp(host, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *u = (struct sockaddr_un *)&c->peer;
+        c->transport = UDP; /* datagrams, just a different family */
+        u->sun_family = AF_UNIX;
+        snprintf(u->sun_path, sizeof(u->sun_path), "%s", host + 5);
+        c->peerlen = sizeof(*u);
+        return (c->fd = timestamped(mkunixsocket(NULL))) != 0;
+    }
+    if (strncmp(host, "shm:", 4) == 0)
+    {
+        c->transport = SHM;
+        c->shmside = 0; /* the client sends on ring 0 */
+        return (c->shm = shmattach(host + 4)) != NULL;
+    }
+    if (strncmp(host, "udp:", 4) == 0)
+        host += 4;
+    else if (strncmp(host, "tcp:", 4) == 0)
+    {
+        c->transport = TCP;
+        host += 4;
+    }
+    else if (strncmp(host, "tcpline:", 8) == 0)
+    {
+        c->transport = TCP;
+        c->framing = FRAME_NEWLINE;
+        host += 8;
+    }
+
+    service = strrchr(host, ':');
+    if (service)
+        *service++ = '\0';
+    else
+    {
+        service = host;
+        host = (char *)defaulthost;
+    }
+
+    if (!getaddr(host, service, &addr))
+        return false;
+    memcpy(&c->peer, addr->ai_addr, addr->ai_addrlen);
+    c->peerlen = addr->ai_addrlen;
+    freeaddrinfo(addr);
+
+    if (c->transport == UDP)
+        return (c->fd = timestamped(mksocket())) != 0;
+
+    c->rxsize = MAXFRAME + sizeof(uint32_t);
+    c->connecttimeout = CONNECTTIMEOUT;
+    if ((c->rxbuf = rxalloc()) == NULL)
+        return false;
+    streamopen(c);
+    return true;
+}
+
+// Sends one message, returns its length or -1 on failure
+ssize_t netsend(struct connection *c, const char *msg, size_t len)
+{
+    clock_gettime(CLOCK_REALTIME, &c->sent);
+    if (c->transport == UDP)
+        return sendto(c->fd, msg, len, 0, (struct sockaddr *)&c->peer, c->peerlen);
+    if (c->transport == SHM)
+        return ringput(&c->shm->rings[c->shmside], msg, len);
+
+    if (!streamready(c))
+        return -1;
+    if (sendframe(c->fd, c->framing, msg, len) == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            streamlost(c); /* a full send buffer leaves it for the next try */
+        return -1;
+    }
+    return len;
+}
+
+/* Records when the message just received arrived: the kernel's stamp if
+   there is one, and the monotonic time that was, by the clocks' offset now */
+static void rxstamp(struct connection *c, const struct timespec *kernel)
+{
+    struct rxstamp *rx = &c->rx;
+    struct timespec now;
+    long long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &rx->mono);
+    clock_gettime(CLOCK_REALTIME, &now);
+    rx->kernel = kernel != NULL;
+    rx->wall = kernel ? *kernel : now;
+    if (!kernel)
+        return;
+
+    ns = (now.tv_sec - kernel->tv_sec) * 1000000000LL + (now.tv_nsec - kernel->tv_nsec);
+    if (ns < 0)
+        ns = 0;
+    ns = rx->mono.tv_sec * 1000000000LL + rx->mono.tv_nsec - ns;
+    rx->mono.tv_sec = ns / 1000000000LL;
+    rx->mono.tv_nsec = ns % 1000000000LL;
+}
+
+// Receives a datagram with the kernel's stamp of when it arrived
+static ssize_t recvstamped(struct connection *c, char *buf, size_t size)
+{
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm;
+    struct timespec *kernel = NULL;
+    ssize_t m;
+
+    if ((m = recvmsg(c->fd, &msg, 0)) < 0)
+        return m;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+            kernel = (struct timespec *)CMSG_DATA(cm);
+    rxstamp(c, kernel);
+    return m;
+}
+
+// Adds how long the message just received waited for netwait() to see it
+static void busystamp(struct connection *c)
+{
+    struct busypoll *b = &c->busy;
+    long long ns;
+
+    if (!c->rx.kernel)
+        return;
+    ns = (b->ready.tv_sec - c->rx.wall.tv_sec) * 1000000000LL + (b->ready.tv_nsec - c->rx.wall.tv_nsec);
+    if (ns < 0)
+        return; /* arrived after the wait, left over from an earlier one */
+    if (b->spun)
+    {
+        b->hitns += ns;
+        b->hitstamps++;
+    }
+    else
+    {
+        b->blockns += ns;
+        b->blockstamps++;
+    }
+}
+
+// Receives one message into buf, returns its length or -1 on failure
+// A stream with only part of a message in fails with EAGAIN rather than waiting
+ssize_t netrecv(struct connection *c, char *buf, size_t size)
+{
+    ssize_t m;
+
+    if (c->transport == UDP)
+    {
+        m = recvstamped(c, buf, size);
+        if (m >= 0 && c->busy.on)
+            busystamp(c);
+        return m;
+    }
+    if (c->transport == SHM)
+    {
+        m = ringget(&c->shm->rings[1 - c->shmside], buf, size);
+        rxstamp(c, NULL);
+        return m;
+    }
+
+    if (!streamready(c))
+        return -1;
+
+    while ((m = takeframe(c->rxbuf, &c->rxlen, c->rxsize, c->framing, buf, size)) < 0)
+    {
+        ssize_t r;
+
+        if (m == -2)
+        {
+            fprintf(stderr, "Message too long, dropping connection\n");
+            streamlost(c);
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        r = recv(c->fd, c->rxbuf + c->rxlen, c->rxsize - c->rxlen, MSG_DONTWAIT);
+        if (r == 0)
+        {
+            streamlost(c); /* peer closed, reopen on the next send */
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                streamlost(c);
+            return -1;
+        }
+        c->rxlen += r;
+    }
+    rxstamp(c, NULL);
+    return m;
+}
+
+// Returns true if a whole stream message is already in the receive buffer
+static int framewaiting(struct connection *c)
+{
+    uint32_t prefix;
+
+    if (c->framing == FRAME_NEWLINE)
+        return memmem(c->rxbuf, c->rxlen, "\n\n", 2) != NULL;
+    if (c->rxlen < sizeof(prefix))
+        return false;
+    memcpy(&prefix, c->rxbuf, sizeof(prefix));
+    return c->rxlen >= sizeof(prefix) + ntohl(prefix);
+}
+
+static long nssince(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000000000L + (now.tv_nsec - t->tv_nsec);
+}
+
+#define MINSPIN 1000L /* ns, the adaptive spin never drops below this */
+
+/* Spins checking the socket for up to the spin limit, then blocks
+
+    A message seen while spinning is a hit.  A message that came after
+    the spin but within the budget raises the limit to twice its wait, so
+    the next one like it is caught; one that took longer than the budget
+    (or none at all) halves it, so waits that spinning can't help stop
+    burning the cpu.
+*/
+static int busywait(struct connection *c, long timeout)
+{
+    struct busypoll *b = &c->busy;
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+    struct timespec start;
+    long limit = b->limit, spun = 0, waited;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (timeout >= 0 && limit > timeout * 1000000L)
+        limit = timeout * 1000000L;
+
+    while (spun < limit)
+    {
+        if (poll(&pfd, 1, 0) > 0)
+        {
+            b->spinns += nssince(&start);
+            b->hits++;
+            b->spun = true;
+            clock_gettime(CLOCK_REALTIME, &b->ready);
+            return true;
+        }
+        spun = nssince(&start);
+    }
+    b->spinns += spun;
+
+    while ((n = poll(&pfd, 1, timeout < 0 ? -1 : timeout - spun / 1000000L)) == -1)
+        if (errno != EINTR)
+            return false;
+    clock_gettime(CLOCK_REALTIME, &b->ready);
+    waited = nssince(&start);
+
+    if (n > 0 && waited <= b->budget)
+        b->limit = 2 * waited < b->budget ? 2 * waited : b->budget;
+    else if (b->limit / 2 >= MINSPIN)
+        b->limit /= 2;
+    if (n == 0)
+        return false;
+    b->blocks++;
+    b->spun = false;
+    return true;
+}
+
+// Waits up to timeout ms (-1 for ever) for something to receive
+// Returns true if netrecv() will have something to read
+int netwait(struct connection *c, long timeout)
+{
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+
+    if (c->transport == SHM)
+        return ringwait(&c->shm->rings[1 - c->shmside], timeout);
+
+    if (c->transport == TCP && c->fd != -1 && framewaiting(c))
+        return true;
+    if (c->transport == TCP && c->fd == -1)
+    {
+        if (timeout > 0) /* nothing can arrive until we reconnect */
+            usleep(timeout * 1000);
+        return false;
+    }
+
+    if (c->busy.on && timeout != 0)
+        return busywait(c, timeout);
+
+    while (poll(&pfd, 1, timeout) == -1)
+        if (errno != EINTR)
+            return false;
+    return pfd.revents != 0;
+}
+
+/* Turns on busy polling: netwait() spins for up to budget ns before it
+   blocks, and the socket asks the kernel to busy poll the device queue
+   for as long (where it is allowed to).  A budget of 0 only measures.
+   Returns false for shm: connections, which always spin a little. */
+int netbusypoll(struct connection *c, long budget)
+{
+    struct busypoll *b = &c->busy;
+    int usecs = budget / 1000;
+
+    if (c->transport == SHM)
+        return false;
+
+    memset(b, 0, sizeof(*b));
+    b->on = true;
+    b->budget = budget;
+    b->limit = budget;
+    clock_gettime(CLOCK_MONOTONIC, &b->since);
+
+#ifdef SO_BUSY_POLL
+    if (usecs > 0 && c->fd != -1 &&
+        setsockopt(c->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+        fprintf(stderr, "No kernel busy polling (%s), spinning in netwait() only\n",
+                strerror(errno));
+#endif
+    return true;
+}
+
+// Throws away anything already received, returns how many messages it was
+static int netdrain(struct connection *c)
+{
+    char scrap[SHMSLOTSIZE];
+    int n = 0;
+
+    while (netwait(c, 0) && netrecv(c, scrap, sizeof(scrap)) >= 0)
+        n++;
+    return n;
+}
+
+// The key of a message's first line, returns its length
+static size_t firstkey(const char *msg, size_t len)
+{
+    size_t k;
+    for (k = 0; k < len && msg[k] != ':' && msg[k] != '\n'; k++)
+        ;
+    return k < len && msg[k] == ':' ? k : 0;
+}
+
+static long msuntil(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/* Sends a request and waits for the matching reply
+
+    Each attempt waits up to timeout ms, then the request is sent again, at
+    most retries more times.  A reply matches when the key on its first line
+    is the request's (condition:? is answered by condition:...); anything
+    else, and anything left over from earlier requests, is stale and thrown
+    away.  The request is sent again from req, so reply must not overlap it.
+    Returns the reply length, or -1 with errno ETIMEDOUT, or EINVAL if the
+    buffers overlap.
+*/
+ssize_t netrequest(struct connection *c, const char *req, size_t len,
+                   char *reply, size_t size, long timeout, int retries)
+{
+    size_t key = firstkey(req, len);
+    int attempt;
+
+    if (reply < req + len && req < reply + size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->stats.requests++;
+    c->stats.stale += netdrain(c);
+    c->connecttimeout = timeout; /* a reconnect comes out of the attempt's time */
+
+    for (attempt = 0; attempt <= retries; attempt++)
+    {
+        struct timespec deadline;
+        long left;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += timeout % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_nsec -= 1000000000;
+            deadline.tv_sec++;
+        }
+
+        if (attempt)
+            c->stats.retries++;
+        if (netsend(c, req, len) == -1)
+            c->stats.senderrors++;
+
+        while ((left = msuntil(&deadline)) > 0 && netwait(c, left))
+        {
+            ssize_t m = netrecv(c, reply, size);
+            if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue; /* part of a stream message, wait for the rest */
+            if (m < 0)
+                break;
+            if (firstkey(reply, m) == key && memcmp(reply, req, key) == 0)
+            {
+                c->stats.replies++;
+                c->stats.replyns += (c->rx.wall.tv_sec - c->sent.tv_sec) * 1000000000LL +
+                                    (c->rx.wall.tv_nsec - c->sent.tv_nsec);
+                return m;
+            }
+            c->stats.stale++;
+        }
+    }
+
+    c->stats.timeouts++;
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+void netclose(struct connection *c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    rxfree(c->rxbuf);
+    c->rxbuf = NULL;
+    if (c->shm)
+        munmap(c->shm, sizeof(*c->shm));
+    c->shm = NULL;
+}
+
+/* Handles a stream server
+
+    Like server() but over TCP: accepts up to MAXCLIENTS persistent
+    connections and calls handlemsg for each framed message.
+    This function does not return.
+*/
+#define MAXCLIENTS 64
+#define CLIENTBUFSIZE 8192
+int streamserver(int listensock, handler_t handlemsg, enum framing framing)
+{
+    static struct
+    {
+        struct sockaddr_in addr;
+        char rxbuf[CLIENTBUFSIZE];
+        size_t rxlen;
+    } clients[MAXCLIENTS];
+    struct pollfd fds[MAXCLIENTS + 1];
+    const size_t buffsize = 4096; /* 4k */
+    char message[buffsize], reply[buffsize];
+    int nfds = 1;
+
+    if (listen(listensock, 16) == -1)
+    {
+        fprintf(stderr, "Error listening on socket: %s\n", strerror(errno));
+        return false;
+    }
+    fds[0] = (struct pollfd){.fd = listensock, .events = POLLIN};
+
+    while (true)
+    {
+        int i;
+
+        if (poll(fds, nfds, -1) == -1)
+            continue;
+
+        // New connection
+        if (fds[0].revents & POLLIN)
+        {
+            struct sockaddr_in addr;
+            socklen_t addrlen = sizeof(addr);
+            int sock = accept(listensock, (struct sockaddr *)&addr, &addrlen);
+            int one = 1;
+
+            if (sock != -1 && nfds == MAXCLIENTS + 1)
+                close(sock); /* full, turn it away */
+            else if (sock != -1)
+            {
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fds[nfds] = (struct pollfd){.fd = sock, .events = POLLIN};
+                clients[nfds - 1].addr = addr;
+                clients[nfds - 1].rxlen = 0;
+                nfds++;
+            }
+        }
+
+        // Messages from connected clients
+        for (i = 1; i < nfds; i++)
+        {
+            ssize_t r, m;
+            bool lost = false;
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            r = recv(fds[i].fd, clients[i - 1].rxbuf + clients[i - 1].rxlen,
+                     CLIENTBUFSIZE - clients[i - 1].rxlen, 0);
+            if (r <= 0)
+                lost = true;
+            else
+                clients[i - 1].rxlen += r;
+
+            while (!lost &&
+                   (m = takeframe(clients[i - 1].rxbuf, &clients[i - 1].rxlen,
+                                  CLIENTBUFSIZE, framing, message, buffsize)) != -1)
+            {
+                size_t replysize;
+
+                if (m == -2)
+                {
+                    lost = true;
+                    break;
+                }
+
+                replysize = handlemsg(message, m, reply, buffsize, &clients[i - 1].addr);
+                if (replysize && sendframe(fds[i].fd, framing, reply, replysize) == -1)
+                    lost = true;
+            }
+
+            if (lost)
+            {
+                close(fds[i].fd);
+                nfds--;
+                fds[i] = fds[nfds]; /* keep the arrays packed */
+                clients[i - 1] = clients[nfds - 1];
+                i--;
+            }
+        }
+    }
+}
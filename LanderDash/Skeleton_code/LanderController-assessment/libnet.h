@@ -3,6 +3,16 @@
  *
  * Dr Alun Moon
  */
+#ifndef _LIBNET_H
+#define _LIBNET_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
 int getaddr(const char *node, const char *service, struct addrinfo **address);
 
 int mksocket(void);
@@ -11,13 +21,137 @@ int bindsocket(int sfd, const struct sockaddr *addr, socklen_t addrlen);
 
 char *addrtouri(struct sockaddr *addr);
 
+int mkunixsocket(const char *path);
+
 typedef size_t (*handler_t)(char *, size_t, char *, size_t, struct sockaddr_in *);
 
 int server(int srvrsock, handler_t handlemsg);
 
+int serverready(int srvrsock, handler_t handlemsg);
+
 extern int cleanupsock;
 
 void finished(int signal);
 
 void cleanup(void);
 
+/* Connections
+
+    A connection to one peer, either UDP datagrams or a persistent TCP
+    stream, chosen by the address:
+        port  host:port  udp:host:port      UDP datagrams
+        tcp:host:port                       TCP, 4 byte length prefix
+        tcpline:host:port                   TCP, blank line ends a message
+        unix:/path                          Unix domain datagrams
+        shm:name                            shared memory rings, same host
+*/
+enum transport
+{
+    UDP, /* and unix: datagrams */
+    TCP,
+    SHM
+};
+
+enum framing
+{
+    FRAME_LENGTH,
+    FRAME_NEWLINE
+};
+
+#define SHMSLOTS 16
+#define SHMSLOTSIZE 4096
+
+struct shmring
+{
+    uint32_t head __attribute__((aligned(64))); /* written by the producer */
+    uint32_t waiting;                           /* consumer asleep on head */
+    uint32_t tail __attribute__((aligned(64))); /* written by the consumer */
+    uint32_t lengths[SHMSLOTS];
+    char slots[SHMSLOTS][SHMSLOTSIZE];
+};
+
+struct shmlink
+{
+    struct shmring rings[2]; /* client to server, server to client */
+};
+
+struct netstats
+{
+    unsigned long requests; /* made by netrequest() */
+    unsigned long replies;  /* matched to a request */
+    unsigned long retries;  /* requests sent again after a timeout */
+    unsigned long timeouts; /* requests that got no reply at all */
+    unsigned long stale;    /* replies thrown away, late or unmatched */
+    unsigned long senderrors;
+    unsigned long connectfails; /* stream connects refused or timed out */
+    unsigned long long replyns; /* last send to reply received, summed over replies */
+};
+
+/* When a message arrived: the kernel's stamp on a datagram, otherwise
+   the time netrecv() took it off the stream or ring */
+struct rxstamp
+{
+    struct timespec wall; /* CLOCK_REALTIME */
+    struct timespec mono; /* CLOCK_MONOTONIC */
+    int kernel;           /* true if stamped by the kernel */
+};
+
+/* Busy polling: netwait() spins for up to limit before it blocks, limit
+   adapting (up to budget) to how long messages actually take to come */
+struct busypoll
+{
+    int on;
+    long budget;                 /* ns, 0 to measure without spinning */
+    long limit;                  /* ns, the spin now */
+    int spun;                    /* the last wait ended while spinning */
+    struct timespec since;       /* CLOCK_MONOTONIC, when turned on */
+    struct timespec ready;       /* CLOCK_REALTIME, when the last wait ended */
+    unsigned long hits;          /* waits that ended while spinning */
+    unsigned long blocks;        /* waits that went on to block */
+    unsigned long long spinns;   /* time spent spinning, all of it cpu */
+    unsigned long long hitns, blockns; /* kernel receive to the wait ending, */
+    unsigned long hitstamps, blockstamps; /* summed over UDP messages */
+};
+
+struct connection
+{
+    enum transport transport;
+    enum framing framing;
+    int fd; /* -1 while a stream is disconnected */
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    struct shmlink *shm;
+    int shmside; /* the ring this end sends on */
+    char *rxbuf; /* stream receive buffer, reused for every message */
+    size_t rxlen, rxsize;
+    struct timespec lastattempt;
+    long connecttimeout; /* ms a stream connect may take, netrequest() sets its own */
+    unsigned long reconnects;
+    struct netstats stats;
+    struct busypoll busy;
+    struct timespec sent; /* CLOCK_REALTIME, the last netsend() */
+    struct rxstamp rx;    /* of the message netrecv() last returned */
+};
+
+int netconnect(struct connection *c, const char *address, const char *defaulthost);
+
+ssize_t netsend(struct connection *c, const char *msg, size_t len);
+
+ssize_t netrecv(struct connection *c, char *buf, size_t size);
+
+int netwait(struct connection *c, long timeout);
+
+ssize_t netrequest(struct connection *c, const char *req, size_t len,
+                   char *reply, size_t size, long timeout, int retries);
+
+void netclose(struct connection *c);
+
+int netbusypoll(struct connection *c, long budget);
+
+int mkstreamsocket(void);
+
+int streamserver(int listensock, handler_t handlemsg, enum framing framing);
+
+int shmserver(const char *name, handler_t handlemsg);
+
+#endif
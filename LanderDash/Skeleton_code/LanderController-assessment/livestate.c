@@ -0,0 +1,92 @@
+/* Live State File
+ * KV5002
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "livestate.h"
+
+// Creates (or resets) the file and maps it, returns NULL on failure
+struct livestate *livestate_create(const char *path)
+{
+    struct livestate *ls;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (fd == -1 || ftruncate(fd, sizeof(struct livestate)) == -1)
+    {
+        fprintf(stderr, "Cannot create live state file %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    ls = mmap(NULL, sizeof(struct livestate), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ls == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map live state file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    memset(&ls->snapshot, 0, sizeof(ls->snapshot));
+    ls->version = LIVESTATE_VERSION;
+    ls->size = sizeof(struct snapshot);
+    __atomic_store_n(&ls->seq, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ls->magic, LIVESTATE_MAGIC, __ATOMIC_RELEASE);
+    return ls;
+}
+
+// Writes a new snapshot, only one thread may publish
+void livestate_publish(struct livestate *ls, const struct command *cmd,
+                       const struct state *st, const struct condition *cond)
+{
+    struct timespec now;
+    uint32_t seq = __atomic_load_n(&ls->seq, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    __atomic_store_n(&ls->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ls->snapshot.updated = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    ls->snapshot.samples++;
+    ls->snapshot.command = *cmd;
+    ls->snapshot.state = *st;
+    ls->snapshot.condition = *cond;
+
+    __atomic_store_n(&ls->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Maps the file read-only, returns NULL if it isn't a live state file
+const struct livestate *livestate_map(const char *path)
+{
+    const struct livestate *ls;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot open live state file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    ls = mmap(NULL, sizeof(struct livestate), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ls == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map live state file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (ls->magic != LIVESTATE_MAGIC || ls->version != LIVESTATE_VERSION ||
+        ls->size != sizeof(struct snapshot))
+    {
+        fprintf(stderr, "%s is not a live state file\n", path);
+        munmap((void *)ls, sizeof(struct livestate));
+        return NULL;
+    }
+    return ls;
+}
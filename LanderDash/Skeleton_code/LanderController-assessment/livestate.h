@@ -0,0 +1,63 @@
+/* Live State File
+ * KV5002
+ *
+ * The controller keeps the latest command, state and condition in a small
+ * memory-mapped file.  Any number of local monitors can map it read-only
+ * and take a consistent snapshot whenever they like, without a system call
+ * and without the controller knowing they are there.
+ *
+ * Consistency is by sequence counter (a seqlock): the writer makes seq odd
+ * while it updates the snapshot and even again when done, and a reader
+ * retries if seq was odd or changed while it copied.
+ */
+#ifndef _LIVESTATE_H
+#define _LIVESTATE_H
+
+#include <stdint.h>
+
+#include "lander.h"
+
+#define LIVESTATE_MAGIC 0x524e444cu /* "LDNR" */
+#define LIVESTATE_VERSION 1
+
+struct snapshot
+{
+    int64_t updated; /* CLOCK_REALTIME, nanoseconds */
+    uint64_t samples;
+    struct command command;
+    struct state state;
+    struct condition condition;
+};
+
+struct livestate
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq; /* odd while the snapshot is being written */
+    uint32_t size; /* sizeof(struct snapshot) */
+    struct snapshot snapshot;
+};
+
+/* Controller side */
+struct livestate *livestate_create(const char *path);
+void livestate_publish(struct livestate *ls, const struct command *cmd,
+                       const struct state *st, const struct condition *cond);
+
+/* Monitor side */
+const struct livestate *livestate_map(const char *path);
+
+// Copies a consistent snapshot, returns its sequence number
+static inline uint32_t livestate_read(const struct livestate *ls, struct snapshot *out)
+{
+    uint32_t before, after;
+    do
+    {
+        before = __atomic_load_n(&ls->seq, __ATOMIC_ACQUIRE);
+        *out = ls->snapshot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&ls->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return after;
+}
+
+#endif
@@ -0,0 +1,429 @@
+/* Load Generator
+ * KV5002
+ *
+ * Floods a datagram server (the lander simulator, the controller's -q
+ * proxy or -s subscription port, or its own -S server) with requests from
+ * many clients and reports the rate it achieved, the loss and the reply
+ * time percentiles.
+ *
+ * Each client is its own socket with at most one request outstanding.  A
+ * client that gives up on its answer closes the socket and opens a new
+ * one, on a new port, so the late answer is dropped by the kernel rather
+ * than taken for the next request's, and every reply it reads belongs to
+ * the request before it.  A client sends when it is due at its share of
+ * the rate and has its answer (or gave up on it), so an overloaded server
+ * shows as a rate below the one offered.
+ * Reply times run from the send to the kernel's receive stamp, leaving
+ * out this program's own scheduling delays.
+ *
+ * usage: loadgen [-c clients] [-T threads] [-r rate] [-d secs] [-t ms]
+ *                [-m kind:weight,...] address
+ *        loadgen -S port
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#include <pthread.h>
+
+#include "libnet.h"
+
+/* The requests it can send, picked at random by weight */
+static struct
+{
+    const char *name;
+    const char *message;
+    int weight;
+} kinds[] = {
+    {"condition", "condition:?\n", 1},
+    {"state", "state:?\n", 1},
+    {"command", "command:!\nmain-engine: 50.000000\nrcs-roll: 0.000000\n", 1},
+};
+#define NKINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+struct client
+{
+    struct connection link;
+    int outstanding;
+    struct timespec due; /* CLOCK_MONOTONIC, the next send */
+    struct timespec sent;
+};
+
+/* One thread's clients and results */
+struct loader
+{
+    pthread_t thread;
+    struct client *clients;
+    int nclients;
+    unsigned seed;
+    unsigned long sent, answered, lost;
+    unsigned long dropped; /* answers whose time there was no memory to keep */
+    unsigned *latencies;   /* ns, one per answer */
+    size_t nlatencies, size;
+};
+
+static const char *address;
+static int nclients = 16, nthreads = 4;
+static double rate = 0; /* requests per second in all, 0 for flat out */
+static double duration = 5;
+static long timeout = 100; /* ms */
+static struct timespec start, end;
+
+static void addns(struct timespec *t, int64_t ns)
+{
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_nsec -= 1000000000L;
+        t->tv_sec++;
+    }
+}
+
+static int64_t diffns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+static const char *pick(unsigned *seed)
+{
+    int total = 0, r;
+    size_t k;
+
+    for (k = 0; k < NKINDS; k++)
+        total += kinds[k].weight;
+    r = rand_r(seed) % total;
+    for (k = 0; r >= kinds[k].weight; k++)
+        r -= kinds[k].weight;
+    return kinds[k].message;
+}
+
+static void record(struct loader *l, int64_t ns)
+{
+    if (l->nlatencies == l->size)
+    {
+        size_t size = l->size ? 2 * l->size : 65536;
+        unsigned *grown = realloc(l->latencies, size * sizeof(*l->latencies));
+        if (grown == NULL)
+        {
+            l->dropped++; /* keep what there is, the percentiles are of those */
+            return;
+        }
+        l->latencies = grown;
+        l->size = size;
+    }
+    l->latencies[l->nlatencies++] = ns < 0 ? 0 : ns;
+}
+
+// Swaps the client's socket for a new one, so an answer still on its way is lost
+static bool reopen(struct client *c)
+{
+    netclose(&c->link);
+    if (netconnect(&c->link, address, "127.0.1.1"))
+        return true;
+    fprintf(stderr, "Can't reopen a client: %s\n", strerror(errno));
+    c->link.fd = -1;
+    return false;
+}
+
+// Sends whatever is due and takes in the replies, until the end
+static void *load(void *data)
+{
+    struct loader *l = data;
+    struct pollfd pfds[l->nclients];
+    int64_t period = rate > 0 ? 1e9 * nclients / rate : 0;
+    char reply[4096];
+    int i;
+
+    for (i = 0; i < l->nclients; i++)
+    {
+        pfds[i].fd = l->clients[i].link.fd;
+        pfds[i].events = POLLIN;
+    }
+
+    while (true)
+    {
+        struct timespec now, wake;
+        int64_t wait;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (diffns(&now, &end) >= 0)
+            break;
+
+        wake = end;
+        for (i = 0; i < l->nclients; i++)
+        {
+            struct client *c = &l->clients[i];
+            struct timespec giveup = c->sent;
+
+            addns(&giveup, timeout * 1000000L);
+            if (c->outstanding && diffns(&now, &giveup) >= 0)
+            {
+                c->outstanding = false;
+                l->lost++;
+                reopen(c);
+                pfds[i].fd = c->link.fd; /* poll() skips a client that couldn't reopen */
+            }
+            if (c->link.fd < 0)
+                continue;
+            if (!c->outstanding && diffns(&now, &c->due) >= 0)
+            {
+                const char *msg = pick(&l->seed);
+                netsend(&c->link, msg, strlen(msg));
+                c->outstanding = true;
+                c->sent = now;
+                l->sent++;
+                addns(&c->due, period);
+                if (diffns(&now, &c->due) > period)
+                    c->due = now; /* fell behind, don't try to catch up */
+                giveup = now;
+                addns(&giveup, timeout * 1000000L);
+            }
+            if (c->outstanding && diffns(&giveup, &wake) < 0)
+                wake = giveup;
+            else if (!c->outstanding && diffns(&c->due, &wake) < 0)
+                wake = c->due;
+        }
+
+        wait = diffns(&wake, &now);
+        struct timespec ts = {.tv_sec = wait / 1000000000L, .tv_nsec = wait % 1000000000L};
+        if (wait < 0)
+            ts.tv_sec = ts.tv_nsec = 0;
+        if (ppoll(pfds, l->nclients, &ts, NULL) <= 0)
+            continue;
+
+        for (i = 0; i < l->nclients; i++)
+        {
+            struct client *c = &l->clients[i];
+            if (!pfds[i].revents)
+                continue;
+            while (netwait(&c->link, 0) && netrecv(&c->link, reply, sizeof(reply)) >= 0)
+            {
+                if (!c->outstanding)
+                    continue; /* a duplicate, late answers go to the closed socket */
+                c->outstanding = false;
+                l->answered++;
+                record(l, (int64_t)(c->link.rx.wall.tv_sec - c->link.sent.tv_sec) * 1000000000L +
+                              (c->link.rx.wall.tv_nsec - c->link.sent.tv_nsec));
+            }
+        }
+    }
+    return NULL;
+}
+
+static int cmpunsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the totals and the reply time percentiles over every thread
+static void report(struct loader *loaders)
+{
+    unsigned long sent = 0, answered = 0, lost = 0, dropped = 0;
+    const double percentiles[] = {50, 90, 99, 99.9, 100};
+    unsigned *all;
+    size_t n = 0, p;
+    double secs = duration;
+    int t;
+
+    for (t = 0; t < nthreads; t++)
+    {
+        sent += loaders[t].sent;
+        answered += loaders[t].answered;
+        lost += loaders[t].lost;
+        dropped += loaders[t].dropped;
+        n += loaders[t].nlatencies;
+    }
+    if ((all = malloc((n ? n : 1) * sizeof(*all))) == NULL)
+    {
+        fprintf(stderr, "No memory to sort %zu reply times\n", n);
+        exit(1);
+    }
+    for (n = 0, t = 0; t < nthreads; t++)
+    {
+        memcpy(all + n, loaders[t].latencies, loaders[t].nlatencies * sizeof(*all));
+        n += loaders[t].nlatencies;
+    }
+    qsort(all, n, sizeof(*all), cmpunsigned);
+
+    printf("%d clients on %d threads for %.1f s\n", nclients, nthreads, secs);
+    if (rate > 0)
+        printf("offered               %10.0f /s\n", rate);
+    else
+        printf("offered                 flat out\n");
+    printf("sent      %10lu  %10.0f /s\n", sent, sent / secs);
+    printf("answered  %10lu  %10.0f /s\n", answered, answered / secs);
+    printf("lost      %10lu  %9.2f %%\n", lost, sent ? 100.0 * lost / sent : 0.0);
+    printf("reply us ");
+    for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+    {
+        size_t i = n ? (size_t)(percentiles[p] / 100 * (n - 1) + 0.5) : 0;
+        printf("  p%g %.1f", percentiles[p], n ? all[i] / 1e3 : 0.0);
+    }
+    printf("\n");
+    if (dropped)
+        printf("(no memory to keep %lu of the reply times)\n", dropped);
+    free(all);
+}
+
+/* ---- Server mode: a libnet server() answering like the lander ---- */
+
+static size_t landerlike(char *msg, size_t msgsize, char *reply, size_t replysize,
+                         struct sockaddr_in *client)
+{
+    static const char condition[] = "condition:=\nfuel:88.5%\naltitude:500.000000\ncontact:flying\n";
+    static const char state[] = "state:=\nx:1\ny:500\nO:0\nx':0\ny':-3\nO':0\n";
+    static const char command[] = "command:=\n";
+    const char *r = command;
+    size_t len;
+
+    if (msgsize >= 10 && memcmp(msg, "condition:", 10) == 0)
+        r = condition;
+    else if (msgsize >= 6 && memcmp(msg, "state:", 6) == 0)
+        r = state;
+    len = strlen(r);
+
+    if (len > replysize)
+        return 0;
+    memcpy(reply, r, len);
+    return len;
+}
+
+static int serve(char *port)
+{
+    struct addrinfo *addr;
+    int s;
+
+    if (!getaddr(NULL, port, &addr))
+        return 1;
+    s = mksocket();
+    if (!s || !bindsocket(s, addr->ai_addr, addr->ai_addrlen))
+        return 1;
+    printf("answering on port %s\n", port);
+    server(s, landerlike);
+    return 0;
+}
+
+/* ---- Arguments ---- */
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-c clients] [-T threads] [-r rate] [-d secs] [-t ms]\n"
+                    "       [-m kind:weight,...] address\n"
+                    "       %s -S port\n"
+                    "kinds are condition, state and command; address as the controller's\n",
+            name, name);
+    exit(1);
+}
+
+// Sets the weights from "state:3,command:1", unnamed kinds get 0
+static int mix(char *list)
+{
+    char *item, *rest;
+    size_t k;
+
+    for (k = 0; k < NKINDS; k++)
+        kinds[k].weight = 0;
+    for (item = strtok_r(list, ",", &rest); item; item = strtok_r(NULL, ",", &rest))
+    {
+        char *w = strchr(item, ':');
+        if (w)
+            *w++ = '\0';
+        for (k = 0; k < NKINDS && strcmp(kinds[k].name, item) != 0; k++)
+            ;
+        if (k == NKINDS)
+            return false;
+        kinds[k].weight = w ? atoi(w) : 1;
+    }
+    for (k = 0; k < NKINDS; k++)
+        if (kinds[k].weight > 0)
+            return true;
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    struct loader *loaders;
+    int opt, t, i;
+
+    while ((opt = getopt(argc, argv, "c:T:r:d:t:m:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'T':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 't':
+            timeout = atol(optarg);
+            break;
+        case 'm':
+            if (!mix(optarg))
+                usage(argv[0]);
+            break;
+        case 'S':
+            return serve(optarg);
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || nclients < 1 || nthreads < 1 || duration <= 0 || timeout <= 0)
+        usage(argv[0]);
+    address = argv[optind];
+    if (nthreads > nclients)
+        nthreads = nclients;
+
+    // Open every client and spread their first sends over one period
+    loaders = calloc(nthreads, sizeof(*loaders));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (t = 0; t < nthreads; t++)
+    {
+        struct loader *l = &loaders[t];
+        l->nclients = nclients / nthreads + (t < nclients % nthreads);
+        l->clients = calloc(l->nclients, sizeof(*l->clients));
+        l->seed = t + 1;
+        for (i = 0; i < l->nclients; i++)
+        {
+            struct client *c = &l->clients[i];
+            if (!netconnect(&c->link, address, "127.0.1.1") || c->link.transport != UDP)
+            {
+                fprintf(stderr, "%s is not a datagram address\n", address);
+                return 1;
+            }
+            c->due = start;
+            if (rate > 0)
+                addns(&c->due, (int64_t)(1e9 * (t + i * nthreads) / rate));
+        }
+    }
+    end = start;
+    addns(&end, (int64_t)(duration * 1e9));
+
+    for (t = 0; t < nthreads; t++)
+        if ((errno = pthread_create(&loaders[t].thread, NULL, load, &loaders[t])))
+        {
+            fprintf(stderr, "Failed creating load thread: %s\n", strerror(errno));
+            return 1;
+        }
+    for (t = 0; t < nthreads; t++)
+        pthread_join(loaders[t].thread, NULL);
+
+    report(loaders);
+    return 0;
+}
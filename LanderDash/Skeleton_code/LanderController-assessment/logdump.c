@@ -0,0 +1,61 @@
+/* Flight Log Dump
+ * KV5002
+ *
+ * Prints flight log segments as the JSON records the controller used to
+ * write to log.csv, one per line, stamped with when each sample arrived:
+ * local time to the nanosecond, and the monotonic clock for lining
+ * records up with each other
+ *
+ * Arguments:
+ *     argv[1...] -> segment files, in order (e.g. flights/flight-*.log)
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "flightlog.h"
+
+// Prints one segment up to its end or the first bad record, false if it isn't one
+static int dump(const char *path)
+{
+    struct flightlog_reader r;
+    struct flightrecord rec;
+    char record[FLIGHTLOG_MAXRECORD];
+    char when[48];
+    struct tm tm;
+    ssize_t len;
+    time_t secs;
+
+    if (!flightlog_openread(&r, path))
+        return false;
+    while ((len = flightlog_next(&r, record, sizeof(record))) >= 0)
+    {
+        if (!flightrecord_unpack(record, len, &rec))
+            continue;
+        secs = rec.wall / 1000000000;
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(when + strlen(when), sizeof(when) - strlen(when), ".%09lld",
+                 (long long)(rec.wall % 1000000000));
+        telemetry_log(stdout, when, rec.mono / 1e9, rec.key, &rec.t);
+        printf("\n");
+    }
+    flightlog_closeread(&r);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s segment...\n", argv[0]);
+        return 1;
+    }
+    for (i = 1; i < argc; i++)
+        if (!dump(argv[i]))
+            failed++;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+/* Live State Monitor
+ * KV5002
+ *
+ * Prints the controller's live state file at a chosen rate
+ *
+ * Arguments:
+ *     argv[1] -> live state file (controller -m option)
+ *     argv[2] -> updates per second (default 2)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "livestate.h"
+
+int main(int argc, char *argv[])
+{
+    const struct livestate *ls;
+    double rate = 2;
+    uint64_t last = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s statefile [rate]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        rate = atof(argv[2]);
+    if (rate <= 0)
+        rate = 2;
+
+    if ((ls = livestate_map(argv[1])) == NULL)
+        return 1;
+
+    while (true)
+    {
+        struct snapshot s;
+        time_t secs;
+        char when[32];
+
+        livestate_read(ls, &s);
+        if (s.samples != last)
+        {
+            secs = s.updated / 1000000000;
+            strftime(when, sizeof(when), "%H:%M:%S", localtime(&secs));
+            printf("%s.%03d #%-8llu fuel %6.2f alt %8.2f %-7s "
+                   "x %7.1f y %7.1f O %6.3f x' %8.4f y' %8.4f O' %8.4f "
+                   "thrust %5.1f rotn %4.1f\n",
+                   when, (int)(s.updated / 1000000 % 1000), (unsigned long long)s.samples,
+                   s.condition.fuel, s.condition.altitude,
+                   contactname(s.condition.contact),
+                   s.state.x, s.state.y, s.state.O,
+                   s.state.dx, s.state.dy, s.state.dO,
+                   s.command.thrust, s.command.rotn);
+            fflush(stdout);
+            last = s.samples;
+        }
+        usleep(1000000 / rate);
+    }
+}
@@ -0,0 +1,269 @@
+/* Trajectory Predictor
+ * KV5002
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2_KERNEL 1
+#include <immintrin.h>
+#endif
+
+#include "predict.h"
+
+const struct model defaultmodel = {
+    .gravity = 1.62,
+    .thrustaccel = 0.05,
+    .rollaccel = 0.5,
+    .burnrate = 0.02,
+    .dt = 0.05,
+    .horizon = 30.0};
+
+/* Score weights */
+#define W_LANDING 10.0 /* per unit of vertical touchdown speed */
+#define W_DRIFT 2.0    /* per unit of sideways touchdown speed */
+#define W_ATTITUDE 20.0 /* per radian of tilt at touchdown */
+#define W_FUEL 0.5     /* per % of fuel */
+#define NOLANDING 1e6  /* a plan still flying at the horizon */
+
+#ifdef EMBEDDED
+/* One fixed set of plans, the arrays side by side in a static arena */
+#define MAXPLANS 1024
+static float arena[2 * PLANSEGMENTS + 3][MAXPLANS] __attribute__((aligned(32)));
+static int arenataken;
+
+int plans_alloc(struct plans *p, int n)
+{
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    p->n = (n + 7) & ~7;
+    if (p->n > MAXPLANS || __atomic_exchange_n(&arenataken, 1, __ATOMIC_ACQUIRE))
+        return 0;
+    for (i = 0; i < PLANSEGMENTS; i++)
+    {
+        p->thrust[i] = arena[2 * i];
+        p->rotn[i] = arena[2 * i + 1];
+    }
+    p->score = arena[2 * PLANSEGMENTS];
+    p->landing = arena[2 * PLANSEGMENTS + 1];
+    p->fuel = arena[2 * PLANSEGMENTS + 2];
+    return 1;
+}
+
+void plans_free(struct plans *p)
+{
+    if (p->score)
+        __atomic_store_n(&arenataken, 0, __ATOMIC_RELEASE);
+    memset(p, 0, sizeof(*p));
+}
+#else
+int plans_alloc(struct plans *p, int n)
+{
+    float **arrays[] = {&p->score, &p->landing, &p->fuel};
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    p->n = (n + 7) & ~7;
+    for (i = 0; i < PLANSEGMENTS; i++)
+    {
+        p->thrust[i] = aligned_alloc(32, p->n * sizeof(float));
+        p->rotn[i] = aligned_alloc(32, p->n * sizeof(float));
+        if (!p->thrust[i] || !p->rotn[i])
+        {
+            plans_free(p); /* what was allocated before it */
+            return 0;
+        }
+    }
+    for (i = 0; i < 3; i++)
+        if (!(*arrays[i] = aligned_alloc(32, p->n * sizeof(float))))
+        {
+            plans_free(p);
+            return 0;
+        }
+    return 1;
+}
+
+void plans_free(struct plans *p)
+{
+    int i;
+    for (i = 0; i < PLANSEGMENTS; i++)
+    {
+        free(p->thrust[i]);
+        free(p->rotn[i]);
+    }
+    free(p->score);
+    free(p->landing);
+    free(p->fuel);
+    memset(p, 0, sizeof(*p));
+}
+#endif
+
+static float uniform(unsigned *seed)
+{
+    return rand_r(seed) / (float)RAND_MAX;
+}
+
+void plans_generate(struct plans *p, const struct command *around, unsigned *seed)
+{
+    int i, s;
+    for (i = 0; i < p->n; i++)
+    {
+        for (s = 0; s < PLANSEGMENTS; s++)
+        {
+            float t = around->thrust, r = around->rotn;
+            if (i > 0)
+            {
+                t = i % 4 == 0 ? uniform(seed) * 100 : t + (uniform(seed) - 0.5) * 40;
+                r = r + (uniform(seed) - 0.5) * 0.6;
+            }
+            p->thrust[s][i] = t < 0 ? 0 : t > 100 ? 100 : t;
+            p->rotn[s][i] = r < -1 ? -1 : r > 1 ? 1 : r;
+        }
+    }
+}
+
+/* Both kernels use the same polynomial sine and cosine, good to well
+   under 1% for the tilts a lander survives (|O| < 1 rad), so that they
+   agree to rounding */
+
+static int predict_scalar(const struct model *m, const struct state *st,
+                          const struct condition *cond, struct plans *p)
+{
+    int steps = m->horizon / m->dt;
+    int perseg = PLANSEGMENT / m->dt;
+    int i, best = 0;
+
+    for (i = 0; i < p->n; i++)
+    {
+        float alt = cond->altitude, O = st->O;
+        float dx = st->dx, dy = st->dy, dO = st->dO;
+        float fuel = cond->fuel;
+        int k;
+
+        for (k = 0; k < steps && alt > 0; k++)
+        {
+            int s = k / perseg < PLANSEGMENTS ? k / perseg : PLANSEGMENTS - 1;
+            float thrust = fuel > 0 ? p->thrust[s][i] : 0;
+            float O2 = O * O;
+            float sinO = O * (1 - O2 / 6 * (1 - O2 / 20));
+            float cosO = 1 - O2 / 2 * (1 - O2 / 12);
+
+            dO += m->rollaccel * p->rotn[s][i] * m->dt;
+            O += dO * m->dt;
+            dx += m->thrustaccel * thrust * sinO * m->dt;
+            dy += (m->thrustaccel * thrust * cosO - m->gravity) * m->dt;
+            alt += dy * m->dt;
+            fuel -= m->burnrate * thrust * m->dt;
+        }
+
+        p->landing[i] = fabsf(dy);
+        p->fuel[i] = cond->fuel - fuel;
+        p->score[i] = alt > 0 ? NOLANDING + alt
+                              : W_LANDING * fabsf(dy) + W_DRIFT * fabsf(dx) +
+                                    W_ATTITUDE * fabsf(O) + W_FUEL * p->fuel[i];
+        if (p->score[i] < p->score[best])
+            best = i;
+    }
+    return best;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2,fma"))) static int predict_avx2(const struct model *m, const struct state *st,
+                                                            const struct condition *cond, struct plans *p)
+{
+    int steps = m->horizon / m->dt;
+    int perseg = PLANSEGMENT / m->dt;
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    const __m256 dt = _mm256_set1_ps(m->dt);
+    const __m256 kthrust = _mm256_set1_ps(m->thrustaccel * m->dt);
+    const __m256 kroll = _mm256_set1_ps(m->rollaccel * m->dt);
+    const __m256 gdt = _mm256_set1_ps(m->gravity * m->dt);
+    const __m256 burn = _mm256_set1_ps(m->burnrate * m->dt);
+    const __m256 sixth = _mm256_set1_ps(1.0f / 6), twentieth = _mm256_set1_ps(1.0f / 20);
+    const __m256 half = _mm256_set1_ps(0.5f), twelfth = _mm256_set1_ps(1.0f / 12);
+    const __m256 signbit = _mm256_set1_ps(-0.0f);
+    int i, best = 0;
+
+    for (i = 0; i < p->n; i += 8)
+    {
+        __m256 alt = _mm256_set1_ps(cond->altitude), O = _mm256_set1_ps(st->O);
+        __m256 dx = _mm256_set1_ps(st->dx), dy = _mm256_set1_ps(st->dy);
+        __m256 dO = _mm256_set1_ps(st->dO), fuel = _mm256_set1_ps(cond->fuel);
+        __m256 flying = _mm256_cmp_ps(alt, zero, _CMP_GT_OQ);
+        __m256 landing, score, used, drift, tilt;
+        int k, j;
+
+        for (k = 0; k < steps && _mm256_movemask_ps(flying); k++)
+        {
+            int s = k / perseg < PLANSEGMENTS ? k / perseg : PLANSEGMENTS - 1;
+            __m256 thrust = _mm256_load_ps(p->thrust[s] + i);
+            __m256 rotn = _mm256_load_ps(p->rotn[s] + i);
+            __m256 O2, sinO, cosO;
+
+            thrust = _mm256_and_ps(thrust, _mm256_cmp_ps(fuel, zero, _CMP_GT_OQ));
+            thrust = _mm256_and_ps(thrust, flying); /* landed lanes stop moving */
+            rotn = _mm256_and_ps(rotn, flying);
+
+            O2 = _mm256_mul_ps(O, O);
+            sinO = _mm256_mul_ps(O, _mm256_fnmadd_ps(_mm256_mul_ps(O2, sixth),
+                                                     _mm256_fnmadd_ps(O2, twentieth, one), one));
+            cosO = _mm256_fnmadd_ps(_mm256_mul_ps(O2, half),
+                                    _mm256_fnmadd_ps(O2, twelfth, one), one);
+
+            dO = _mm256_fmadd_ps(kroll, rotn, dO);
+            O = _mm256_blendv_ps(O, _mm256_fmadd_ps(dO, dt, O), flying);
+            dx = _mm256_fmadd_ps(_mm256_mul_ps(kthrust, thrust), sinO, dx);
+            dy = _mm256_blendv_ps(dy, _mm256_sub_ps(_mm256_fmadd_ps(_mm256_mul_ps(kthrust, thrust), cosO, dy), gdt), flying);
+            alt = _mm256_blendv_ps(alt, _mm256_fmadd_ps(dy, dt, alt), flying);
+            fuel = _mm256_fnmadd_ps(burn, thrust, fuel);
+            flying = _mm256_and_ps(flying, _mm256_cmp_ps(alt, zero, _CMP_GT_OQ));
+        }
+
+        landing = _mm256_andnot_ps(signbit, dy);
+        drift = _mm256_andnot_ps(signbit, dx);
+        tilt = _mm256_andnot_ps(signbit, O);
+        used = _mm256_sub_ps(_mm256_set1_ps(cond->fuel), fuel);
+        score = _mm256_mul_ps(_mm256_set1_ps(W_LANDING), landing);
+        score = _mm256_fmadd_ps(_mm256_set1_ps(W_DRIFT), drift, score);
+        score = _mm256_fmadd_ps(_mm256_set1_ps(W_ATTITUDE), tilt, score);
+        score = _mm256_fmadd_ps(_mm256_set1_ps(W_FUEL), used, score);
+        score = _mm256_blendv_ps(score, _mm256_add_ps(_mm256_set1_ps(NOLANDING), alt),
+                                 _mm256_cmp_ps(alt, zero, _CMP_GT_OQ));
+
+        _mm256_store_ps(p->landing + i, landing);
+        _mm256_store_ps(p->fuel + i, used);
+        _mm256_store_ps(p->score + i, score);
+        for (j = i; j < i + 8; j++)
+            if (p->score[j] < p->score[best])
+                best = j;
+    }
+    return best;
+}
+
+static int haveavx2(void)
+{
+    static int have = -1;
+    if (have < 0)
+        have = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return have;
+}
+#else
+#define haveavx2() 0
+#endif
+
+int predict(const struct model *m, const struct state *st,
+            const struct condition *cond, struct plans *p)
+{
+#ifdef HAVE_AVX2_KERNEL
+    if (haveavx2())
+        return predict_avx2(m, st, cond, p);
+#endif
+    return predict_scalar(m, st, cond, p);
+}
+
+const char *predict_kernel(void)
+{
+    return haveavx2() ? "avx2" : "scalar";
+}
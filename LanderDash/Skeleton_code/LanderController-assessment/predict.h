@@ -0,0 +1,54 @@
+/* Trajectory Predictor
+ * KV5002
+ *
+ * Forward-simulates many candidate command plans from the current state
+ * at once and scores each on touchdown speed, attitude and fuel.  Plans
+ * are stored structure-of-arrays so eight run side by side in AVX2
+ * registers; there is a scalar version for machines without it.
+ */
+#ifndef _PREDICT_H
+#define _PREDICT_H
+
+#include "lander.h"
+
+/* A plan holds each command for PLANSEGMENT seconds */
+#define PLANSEGMENTS 4
+#define PLANSEGMENT 1.0
+
+/* The lander physics, in the simulator's units */
+struct model
+{
+    float gravity;     /* downward acceleration */
+    float thrustaccel; /* acceleration per unit of main-engine */
+    float rollaccel;   /* angular acceleration per unit of rcs-roll */
+    float burnrate;    /* fuel (%) per unit of main-engine per second */
+    float dt;          /* simulation step, s */
+    float horizon;     /* give up on a plan that hasn't landed by then, s */
+};
+
+extern const struct model defaultmodel;
+
+struct plans
+{
+    int n; /* a multiple of 8 */
+    float *thrust[PLANSEGMENTS];
+    float *rotn[PLANSEGMENTS];
+    float *score;   /* lower is better, filled in by predict() */
+    float *landing; /* touchdown speed */
+    float *fuel;    /* fuel used */
+};
+
+int plans_alloc(struct plans *p, int n);
+void plans_free(struct plans *p);
+
+/* Fill the plans with random variations around a command, plan 0 keeps it */
+void plans_generate(struct plans *p, const struct command *around, unsigned *seed);
+
+/* Score every plan from the given state, returns the index of the best */
+int predict(const struct model *m, const struct state *st,
+            const struct condition *cond, struct plans *p);
+
+/* Which kernel predict() uses, "avx2" or "scalar" */
+const char *predict_kernel(void);
+
+#endif
@@ -0,0 +1,98 @@
+/* Lander Query Proxy
+ * KV5002
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "lander.h"
+#include "proxy.h"
+
+struct cached
+{
+    char reply[PROXYREPLYSIZE];
+    size_t len;               /* 0 until the lander has answered */
+    struct timespec updated;  /* CLOCK_MONOTONIC */
+};
+
+static struct cached cache[PROXYQUERIES];
+static const char *queries[PROXYQUERIES] = {conditionq, stateq};
+static struct proxystats stats;
+static int64_t maxage = 1000000000L;
+static sem_t cachelock;
+static pthread_once_t cacheonce = PTHREAD_ONCE_INIT;
+
+static void cacheinit(void)
+{
+    sem_init(&cachelock, 0, 1);
+}
+
+void proxy_maxage(int64_t ns)
+{
+    maxage = ns;
+}
+
+void proxy_update(enum proxyquery q, const char *reply, size_t len)
+{
+    struct cached *c = &cache[q];
+
+    if (len > sizeof(c->reply))
+        return;
+    pthread_once(&cacheonce, cacheinit);
+    sem_wait(&cachelock); /* Enter critical section */
+    memcpy(c->reply, reply, len);
+    c->len = len;
+    clock_gettime(CLOCK_MONOTONIC, &c->updated);
+    sem_post(&cachelock); /* Exit critical section */
+}
+
+void proxy_stats(struct proxystats *out)
+{
+    pthread_once(&cacheonce, cacheinit);
+    sem_wait(&cachelock);
+    *out = stats;
+    sem_post(&cachelock);
+}
+
+// Answers a query with the cached reply, or not at all
+size_t proxyhandler(char *msg, size_t msgsize,
+                    char *reply, size_t replysize,
+                    struct sockaddr_in *client)
+{
+    struct timespec now;
+    struct cached *c;
+    size_t len = 0;
+    int q;
+
+    for (q = 0; q < PROXYQUERIES; q++)
+    {
+        size_t n = strcspn(queries[q], "\n"); /* the newline is optional */
+        if (msgsize >= n && memcmp(msg, queries[q], n) == 0)
+            break;
+    }
+
+    pthread_once(&cacheonce, cacheinit);
+    sem_wait(&cachelock); /* Enter critical section */
+    if (q == PROXYQUERIES)
+        stats.unknown++;
+    else
+    {
+        c = &cache[q];
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (c->len == 0 || c->len > replysize ||
+            (int64_t)(now.tv_sec - c->updated.tv_sec) * 1000000000L + (now.tv_nsec - c->updated.tv_nsec) > maxage)
+            stats.stale++;
+        else
+        {
+            memcpy(reply, c->reply, c->len);
+            len = c->len;
+            stats.served++;
+        }
+    }
+    sem_post(&cachelock); /* Exit critical section */
+    return len;
+}
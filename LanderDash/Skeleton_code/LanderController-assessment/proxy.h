@@ -0,0 +1,47 @@
+/* Lander Query Proxy
+ * KV5002
+ *
+ * Answers the lander's own condition:? and state:? queries from the
+ * replies the controller last had from the lander, so any number of local
+ * tools can read the lander while only the controller polls it.  Each
+ * reply is stored as it came off the wire, so serving it is one copy.
+ * A reply older than the maximum age is not served: the client sees a
+ * lost datagram and asks again later.
+ */
+#ifndef _PROXY_H
+#define _PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define PROXYREPLYSIZE 1000
+
+enum proxyquery
+{
+    PROXY_CONDITION,
+    PROXY_STATE,
+    PROXYQUERIES
+};
+
+struct proxystats
+{
+    unsigned long served;  /* queries answered */
+    unsigned long stale;   /* not answered, the reply was too old */
+    unsigned long unknown; /* not a query the proxy answers */
+};
+
+/* How old (ns) a reply may be and still be served */
+void proxy_maxage(int64_t ns);
+
+/* Stores the lander's latest reply to a query, before it is parsed */
+void proxy_update(enum proxyquery q, const char *reply, size_t len);
+
+void proxy_stats(struct proxystats *out);
+
+/* A libnet handler_t for server() and serverready() */
+size_t proxyhandler(char *msg, size_t msgsize,
+                    char *reply, size_t replysize,
+                    struct sockaddr_in *client);
+
+#endif
@@ -0,0 +1,305 @@
+/* Dashboard Subscriber Registry
+ * KV5002
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pubsub.h"
+
+struct subscriber
+{
+    struct sockaddr_in addr;
+    unsigned fields;
+    int64_t period; /* nanoseconds between updates */
+    struct timespec next;
+    unsigned version; /* of the data last sent */
+    bool sent;        /* anything sent since subscribing */
+};
+
+static struct subscriber registry[MAXSUBSCRIBERS];
+static int nsubscribers = 0;
+static sem_t registrylock;
+static pthread_once_t registryonce = PTHREAD_ONCE_INIT;
+
+static void registryinit(void)
+{
+    sem_init(&registrylock, 0, 1);
+}
+
+static void addns(struct timespec *t, int64_t ns)
+{
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_nsec -= 1000000000L;
+        t->tv_sec++;
+    }
+}
+
+static bool before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static bool sameaddr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Adds a subscriber, or updates it if the address is already registered
+// Returns false if the registry is full
+int subscribe(const struct sockaddr_in *addr, unsigned fields, float rate)
+{
+    int i;
+    bool ok = true;
+
+    if (!(rate > 0 && rate <= MAXRATE)) /* NaN fails every comparison */
+        rate = MAXRATE;
+
+    pthread_once(&registryonce, registryinit);
+    sem_wait(&registrylock); /* Enter critical section */
+
+    for (i = 0; i < nsubscribers; i++)
+        if (sameaddr(&registry[i].addr, addr))
+            break;
+
+    if (i == nsubscribers)
+    {
+        if (nsubscribers == MAXSUBSCRIBERS)
+            ok = false;
+        else
+            nsubscribers++;
+    }
+
+    if (ok)
+    {
+        registry[i].addr = *addr;
+        registry[i].fields = fields & F_ALL;
+        registry[i].period = (int64_t)(1e9 / rate);
+        clock_gettime(CLOCK_MONOTONIC, &registry[i].next);
+        registry[i].sent = false;
+    }
+
+    sem_post(&registrylock); /* Exit critical section */
+    return ok;
+}
+
+// Removes a subscriber, returns false if it was not registered
+int unsubscribe(const struct sockaddr_in *addr)
+{
+    int i;
+    bool found = false;
+
+    pthread_once(&registryonce, registryinit);
+    sem_wait(&registrylock); /* Enter critical section */
+
+    for (i = 0; i < nsubscribers; i++)
+    {
+        if (sameaddr(&registry[i].addr, addr))
+        {
+            registry[i] = registry[--nsubscribers]; /* keep the array packed */
+            found = true;
+            break;
+        }
+    }
+
+    sem_post(&registrylock); /* Exit critical section */
+    return found;
+}
+
+int subscribers(void)
+{
+    return nsubscribers;
+}
+
+// Parses a comma separated list of field names into a mask
+static unsigned parsefields(char *list)
+{
+    unsigned mask = 0;
+    char *name, *rest;
+
+    for (name = strtok_r(list, ", ", &rest);
+         name != NULL;
+         name = strtok_r(NULL, ", ", &rest))
+    {
+        int f;
+        if (strcmp(name, "all") == 0)
+            return F_ALL;
+        for (f = 0; f < NFIELDS; f++)
+            if (strcmp(name, fieldnames[f]) == 0)
+                mask |= 1 << f;
+    }
+    return mask;
+}
+
+/* Handles registration messages, for use with server()
+
+    subscribe:!             unsubscribe:!
+    fields:fuel,altitude    port:65250
+    rate:2
+    port:65250
+
+    The port line is optional, by default updates go to the address the
+    request came from.
+*/
+size_t subscriptionhandler(char *msg, size_t msgsize,
+                           char *reply, size_t replysize,
+                           struct sockaddr_in *client)
+{
+    char text[msgsize + 1];
+    char *line, *rest;
+    struct sockaddr_in addr = *client;
+    unsigned fields = F_FUEL | F_ALTITUDE;
+    float rate = 2;
+    enum { NONE, SUBSCRIBE, UNSUBSCRIBE } request = NONE;
+    bool ok = false;
+
+    memcpy(text, msg, msgsize);
+    text[msgsize] = '\0';
+
+    for (line = strtok_r(text, "\r\n", &rest);
+         line != NULL;
+         line = strtok_r(NULL, "\r\n", &rest))
+    {
+        char *key, *value, *r;
+        key = strtok_r(line, ":", &r);
+        value = strtok_r(NULL, "", &r);
+        if (key == NULL || value == NULL)
+            continue;
+
+        if (strcmp(key, "subscribe") == 0)
+            request = SUBSCRIBE;
+        if (strcmp(key, "unsubscribe") == 0)
+            request = UNSUBSCRIBE;
+        if (strcmp(key, "fields") == 0)
+            fields = parsefields(value);
+        if (strcmp(key, "rate") == 0)
+            sscanf(value, "%f", &rate);
+        if (strcmp(key, "port") == 0)
+            addr.sin_port = htons(atoi(value));
+    }
+
+    switch (request)
+    {
+    case SUBSCRIBE:
+        ok = fields && subscribe(&addr, fields, rate);
+        return snprintf(reply, replysize, "subscribe:%s\nsubscribers:%d\n",
+                        ok ? "ok" : "error", nsubscribers);
+    case UNSUBSCRIBE:
+        ok = unsubscribe(&addr);
+        return snprintf(reply, replysize, "unsubscribe:%s\nsubscribers:%d\n",
+                        ok ? "ok" : "error", nsubscribers);
+    default:
+        return 0; /* not for us, ignore */
+    }
+}
+
+// Sends every message queued so far in one system call (or as few as it takes)
+static void flush(int sock, struct mmsghdr *msgs, int n)
+{
+    int sent = 0;
+    while (sent < n)
+    {
+        int r = sendmmsg(sock, msgs + sent, n - sent, 0);
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            sent++; /* skip the message that failed */
+        }
+        else
+            sent += r;
+    }
+}
+
+/* Sends an update to every subscriber that is due one
+
+    Called periodically by the dashboard thread, at up to MAXRATE.  Each
+    distinct field set is formatted once and the same buffer is shared by
+    all subscribers that asked for it.  A subscriber already sent this
+    version of the data is skipped and stays due, so it gets the next
+    version as soon as it is published.  Not reentrant: only one thread
+    may publish.  Returns the number of updates sent.
+*/
+#define MAXMASKS 32
+#define UPDATESIZE 512
+int publish(int sock, formatter_t format, unsigned version)
+{
+    static char updates[MAXMASKS][UPDATESIZE];
+    static struct iovec iov[MAXMASKS];
+    static struct mmsghdr msgs[MAXSUBSCRIBERS];
+    unsigned masks[MAXMASKS];
+    int nmasks = 0, n = 0, total = 0;
+    struct timespec now;
+    int i;
+
+    pthread_once(&registryonce, registryinit);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    sem_wait(&registrylock); /* Enter critical section */
+
+    for (i = 0; i < nsubscribers; i++)
+    {
+        struct subscriber *s = &registry[i];
+        int m;
+
+        if (before(&now, &s->next) || (s->sent && s->version == version))
+            continue;
+        s->version = version;
+        s->sent = true;
+        addns(&s->next, s->period);
+        if (before(&s->next, &now)) /* fell behind, don't send a burst */
+        {
+            s->next = now;
+            addns(&s->next, s->period);
+        }
+
+        for (m = 0; m < nmasks; m++)
+            if (masks[m] == s->fields)
+                break;
+        if (m == nmasks)
+        {
+            if (nmasks == MAXMASKS) /* cache full, send what we have */
+            {
+                flush(sock, msgs, n);
+                total += n;
+                n = nmasks = m = 0;
+            }
+            masks[m] = s->fields;
+            iov[m].iov_base = updates[m];
+            iov[m].iov_len = format(updates[m], UPDATESIZE, s->fields);
+            if (iov[m].iov_len >= UPDATESIZE)
+                iov[m].iov_len = UPDATESIZE - 1;
+            nmasks++;
+        }
+
+        msgs[n].msg_hdr = (struct msghdr){
+            .msg_name = &s->addr,
+            .msg_namelen = sizeof(s->addr),
+            .msg_iov = &iov[m],
+            .msg_iovlen = 1};
+        n++;
+    }
+
+    flush(sock, msgs, n);
+    total += n;
+
+    sem_post(&registrylock); /* Exit critical section */
+    return total;
+}
@@ -0,0 +1,39 @@
+/* Dashboard Subscriber Registry
+ * KV5002
+ *
+ * Dashboards register with the controller, naming the fields they want
+ * and how often they want them.  Each update is formatted once per
+ * distinct field set and sent to every subscriber with sendmmsg(2).
+ */
+#ifndef _PUBSUB_H
+#define _PUBSUB_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "telemetry.h"
+
+/* Fields a dashboard can subscribe to are the telemetry fields, F_FUEL
+   etc. from telemetry.h */
+
+#define MAXSUBSCRIBERS 1024
+#define MAXRATE 20.0 /* Hz, the rate publish() is expected to be called at */
+
+/* Formats the fields in the mask into buffer, returns the length */
+typedef size_t (*formatter_t)(char *buffer, size_t size, unsigned fields);
+
+int subscribe(const struct sockaddr_in *addr, unsigned fields, float rate);
+
+int unsubscribe(const struct sockaddr_in *addr);
+
+int subscribers(void);
+
+size_t subscriptionhandler(char *msg, size_t msgsize,
+                           char *reply, size_t replysize,
+                           struct sockaddr_in *client);
+
+/* Sends an update to every subscriber that is due one and has not had
+   this version of the data yet, returns the number sent */
+int publish(int sock, formatter_t format, unsigned version);
+
+#endif
@@ -0,0 +1,251 @@
+/* Real-time Scheduling
+ * KV5002
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+#include "rt.h"
+
+static void addns(struct timespec *t, int64_t ns)
+{
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_nsec -= 1000000000L;
+        t->tv_sec++;
+    }
+}
+
+static int64_t diffns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+// Starts a period, the first release is one period from now
+int period_init(struct period *p, int64_t ns)
+{
+    memset(p, 0, sizeof(*p));
+    p->ns = ns;
+    p->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (p->timerfd == -1)
+        fprintf(stderr, "No timerfd, using clock_nanosleep: %s\n", strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &p->next);
+    return true;
+}
+
+void period_set(struct period *p, int64_t ns)
+{
+    p->ns = ns;
+}
+
+int period_advance(struct period *p)
+{
+    struct timespec now;
+
+    addns(&p->next, p->ns);
+    p->releases++;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (diffns(&now, &p->next) > 0)
+    {
+        /* overran: count it and start again from now rather than
+           releasing a burst of catch-up periods */
+        p->missed++;
+        p->next = now;
+        return false;
+    }
+    return true;
+}
+
+void period_started(struct period *p)
+{
+    struct timespec now;
+    int64_t late;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = diffns(&now, &p->next);
+    if (late > p->maxlatency)
+        p->maxlatency = late;
+}
+
+int period_sleep(struct period *p, int fd)
+{
+    struct pollfd pfd[2] = {{.fd = p->timerfd, .events = POLLIN},
+                            {.fd = fd, .events = POLLIN}};
+    uint64_t expirations;
+
+    if (p->timerfd != -1)
+    {
+        struct itimerspec when = {.it_value = p->next};
+        timerfd_settime(p->timerfd, TFD_TIMER_ABSTIME, &when, NULL);
+        if (fd == -1)
+        {
+            while (read(p->timerfd, &expirations, sizeof(expirations)) == -1 && errno == EINTR)
+                ;
+            return true;
+        }
+        while (poll(pfd, 2, -1) == -1 && errno == EINTR)
+            ;
+        if (!(pfd[0].revents & POLLIN))
+            return false;
+        read(p->timerfd, &expirations, sizeof(expirations));
+        return true;
+    }
+
+    if (fd != -1)
+    {
+        struct timespec now;
+        long ms;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (diffns(&p->next, &now) + 999999L) / 1000000L;
+        if (ms > 0 && poll(&pfd[1], 1, ms) > 0)
+            return false;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &p->next, NULL) == EINTR)
+        ;
+    return true;
+}
+
+int period_wait(struct period *p)
+{
+    if (!period_advance(p))
+        return false;
+    period_sleep(p, -1);
+    period_started(p);
+    return true;
+}
+
+int rt_thread(pthread_t thread, const char *name, int priority, int cpu)
+{
+    int err;
+    bool ok = true;
+
+    if (priority > 0)
+    {
+        struct sched_param param = {.sched_priority = priority};
+        if ((err = pthread_setschedparam(thread, SCHED_FIFO, &param)))
+        {
+            fprintf(stderr, "Cannot make %s thread real-time: %s\n", name, strerror(err));
+            ok = false;
+        }
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)))
+        {
+            fprintf(stderr, "Cannot pin %s thread to cpu %d: %s\n", name, cpu, strerror(err));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int rt_lockmemory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    {
+        fprintf(stderr, "Cannot lock memory: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* ---- Thread stacks ---- */
+
+#define GUARD 4096       /* bytes, a page at the low end of each stack */
+#define STACKFILL 0xa5
+
+static struct
+{
+    const char *name;
+    char *stack; /* NULL if not ours to measure */
+    size_t size;
+} threads[MAXSTACKS];
+static int nthreads;
+static pthread_mutex_t threadslock = PTHREAD_MUTEX_INITIALIZER;
+
+#if THREADSTACK > 0
+static char stacks[MAXSTACKS][THREADSTACK] __attribute__((aligned(GUARD)));
+#endif
+
+int rt_create(pthread_t *thread, const char *name, void *(*start)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int slot, err;
+
+    pthread_attr_init(&attr);
+    pthread_mutex_lock(&threadslock);
+    slot = nthreads < MAXSTACKS ? nthreads++ : -1;
+    if (slot >= 0)
+    {
+        threads[slot].name = name;
+        threads[slot].stack = NULL;
+    }
+#if THREADSTACK > 0
+    if (slot >= 0)
+    {
+        /* the stack grows down onto the guard page, and the fill shows how far */
+        memset(stacks[slot] + GUARD, STACKFILL, THREADSTACK - GUARD);
+        if (mprotect(stacks[slot], GUARD, PROT_NONE) == -1)
+            fprintf(stderr, "No guard page for the %s stack: %s\n", name, strerror(errno));
+        pthread_attr_setstack(&attr, stacks[slot], THREADSTACK);
+        threads[slot].stack = stacks[slot] + GUARD;
+        threads[slot].size = THREADSTACK - GUARD;
+    }
+    else
+        pthread_attr_setstacksize(&attr, THREADSTACK);
+#endif
+    pthread_mutex_unlock(&threadslock);
+
+    err = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+int rt_stackuse(struct stackuse *out, int max)
+{
+    int i, n = 0;
+    size_t untouched;
+
+    pthread_mutex_lock(&threadslock);
+    for (i = 0; i < nthreads && n < max; i++, n++)
+    {
+        out[n].name = threads[i].name;
+        out[n].size = threads[i].stack ? threads[i].size : 0;
+        out[n].used = 0;
+        if (!threads[i].stack)
+            continue;
+        for (untouched = 0; untouched < threads[i].size &&
+                            (unsigned char)threads[i].stack[untouched] == STACKFILL;
+             untouched++)
+            ;
+        out[n].used = threads[i].size - untouched;
+    }
+    pthread_mutex_unlock(&threadslock);
+    return n;
+}
+
+long rt_peakrss(void)
+{
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
@@ -0,0 +1,78 @@
+/* Real-time Scheduling
+ * KV5002
+ *
+ * Fixed-rate periods released at absolute deadlines, so a thread's period
+ * does not drift by the time its work takes, plus the knobs for running
+ * the lander link as a real-time thread.
+ */
+#ifndef _RT_H
+#define _RT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+struct period
+{
+    int timerfd;          /* absolute timer, -1 to use clock_nanosleep() */
+    struct timespec next; /* the next release */
+    int64_t ns;           /* length of the period */
+    unsigned long releases;
+    unsigned long missed; /* releases already past when the thread came to wait */
+    long maxlatency;      /* worst wake-up latency after a release, ns */
+};
+
+int period_init(struct period *p, int64_t ns);
+
+/* Change the length, the next release is one new period after the last */
+void period_set(struct period *p, int64_t ns);
+
+/* Wait for the next release, returns false if it was missed */
+int period_wait(struct period *p);
+
+/* The parts of period_wait() for callers that do their own waiting: move
+   on to the next release, returning false if it has already passed; sleep
+   until it, or until fd (if not -1) is readable, returning true for the
+   release and false for fd; note when the released work actually starts */
+int period_advance(struct period *p);
+int period_sleep(struct period *p, int fd);
+void period_started(struct period *p);
+
+/* Make a thread SCHED_FIFO at priority (0 to leave it alone) and pin it to
+   cpu (-1 to leave it alone) */
+int rt_thread(pthread_t thread, const char *name, int priority, int cpu);
+
+/* Lock all memory, current and future, so page faults can't stall us */
+int rt_lockmemory(void);
+
+/* ---- Thread stacks ----
+
+    rt_create() is pthread_create() with the stack size chosen here.  The
+    embedded build gives each thread a small static stack, filled with a
+    pattern and with a guard page at the end it grows towards, so how
+    much of it a thread has ever used can be read off.
+*/
+#ifdef EMBEDDED
+#define THREADSTACK (64 * 1024)
+#else
+#define THREADSTACK 0 /* the system's default, not measured */
+#endif
+#define MAXSTACKS 24
+
+struct stackuse
+{
+    const char *name;
+    size_t size; /* usable bytes, 0 if not measured */
+    size_t used; /* the most ever used */
+};
+
+/* Returns 0 or an error number, as pthread_create() does */
+int rt_create(pthread_t *thread, const char *name, void *(*start)(void *), void *arg);
+
+/* Fills in up to max threads' stack use, returns how many */
+int rt_stackuse(struct stackuse *out, int max);
+
+/* The most memory the process has had resident, kB */
+long rt_peakrss(void);
+
+#endif
@@ -0,0 +1,140 @@
+/* Telemetry Schema
+ * KV5002
+ *
+ * Everything here is expanded from the field lists in telemetry.h, one
+ * line of code per field per function.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lander.h"
+#include "telemetry.h"
+
+#define KEYNAME(NAME, member, key, wire, type) key,
+const char *fieldnames[NFIELDS] = {TELEMETRY_FIELDS(KEYNAME)};
+
+void telemetry_gather(struct telemetry *t, const struct command *cmd,
+                      const struct state *st, const struct condition *cond)
+{
+#define FROMCOMMAND(NAME, member, key, wire, type) t->member = cmd->member;
+#define FROMSTATE(NAME, member, key, wire, type) t->member = st->member;
+#define FROMCONDITION(NAME, member, key, wire, type) t->member = cond->member;
+    COMMAND_FIELDS(FROMCOMMAND)
+    STATE_FIELDS(FROMSTATE)
+    CONDITION_FIELDS(FROMCONDITION)
+}
+
+/* ---- Text ---- */
+
+static size_t text_FLOAT(char *buffer, size_t size, size_t len, const char *key, float v)
+{
+    return len + snprintf(buffer + len, size - len, "%s:%f\n", key, v);
+}
+#define text_PERCENT text_FLOAT
+
+static size_t text_CONTACT(char *buffer, size_t size, size_t len, const char *key, int v)
+{
+    return len + snprintf(buffer + len, size - len, "%s:%s\n", key, contactname(v));
+}
+
+size_t telemetry_format(char *buffer, size_t size, const struct telemetry *t,
+                        unsigned fields)
+{
+    size_t len = 0;
+
+    if (size == 0)
+        return 0;
+    buffer[0] = '\0';
+#define TEXT(NAME, member, key, wire, type) \
+    if ((fields & F_##NAME) && len < size)  \
+        len = text_##type(buffer, size, len, key, t->member);
+    TELEMETRY_FIELDS(TEXT)
+    return len < size ? len : size - 1; /* truncated */
+}
+
+/* ---- Binary ---- */
+
+size_t telemetry_encode(void *buffer, size_t size, const struct telemetry *t,
+                        unsigned fields)
+{
+    char *p = buffer;
+    uint32_t mask = fields & F_ALL;
+
+    if (size < sizeof(mask) + 4 * __builtin_popcount(mask))
+        return 0;
+    memcpy(p, &mask, sizeof(mask));
+    p += sizeof(mask);
+#define ENCODE(NAME, member, key, wire, type) \
+    if (mask & F_##NAME)                      \
+    {                                         \
+        memcpy(p, &t->member, 4);             \
+        p += 4;                               \
+    }
+    TELEMETRY_FIELDS(ENCODE)
+    return p - (char *)buffer;
+}
+
+unsigned telemetry_decode(const void *buffer, size_t size, struct telemetry *t)
+{
+    const char *p = buffer;
+    uint32_t mask;
+
+    if (size < sizeof(mask))
+        return 0;
+    memcpy(&mask, p, sizeof(mask));
+    p += sizeof(mask);
+    if ((mask & ~F_ALL) || size != sizeof(mask) + 4 * __builtin_popcount(mask))
+        return 0;
+#define DECODE(NAME, member, key, wire, type) \
+    if (mask & F_##NAME)                      \
+    {                                         \
+        memcpy(&t->member, p, 4);             \
+        p += 4;                               \
+    }
+    TELEMETRY_FIELDS(DECODE)
+    return mask;
+}
+
+/* Every field is four bytes in the binary encoding */
+#define FOURBYTES(NAME, member, key, wire, type) \
+    _Static_assert(sizeof(CTYPE_##type) == 4, key " is not four bytes");
+TELEMETRY_FIELDS(FOURBYTES)
+
+/* ---- Log ---- */
+
+static void log_FLOAT(FILE *f, const char *sep, const char *key, float v)
+{
+    fprintf(f, "%s\"%s\":\"%.4g\"", sep, key, v);
+}
+#define log_PERCENT log_FLOAT
+
+static void log_CONTACT(FILE *f, const char *sep, const char *key, int v)
+{
+    fprintf(f, "%s\"%s\":\"%s\"", sep, key, contactname(v));
+}
+
+/* {"time":[{"mono":"s.ns","key":"up","lander":[{"command":[{...}],
+   "state":[{...}], "condition":[{...}]}]}]} with the fields of each group inside */
+int telemetry_log(FILE *f, const char *time, double mono, const char *key,
+                  const struct telemetry *t)
+{
+    const char *sep;
+
+#define LOG(NAME, member, key, wire, type) \
+    log_##type(f, sep, key, t->member);    \
+    sep = ", ";
+    fprintf(f, "{\"%s\":[{\"mono\":\"%.9f\",\"key\":\"%s\",\"lander\":[{\"command\":[{",
+            time, mono, key);
+    sep = "";
+    COMMAND_FIELDS(LOG)
+    fprintf(f, "}], \"state\":[{");
+    sep = "";
+    STATE_FIELDS(LOG)
+    fprintf(f, "}], \"condition\":[{");
+    sep = "";
+    CONDITION_FIELDS(LOG)
+    fprintf(f, "}]}]}]}");
+    return !ferror(f);
+}
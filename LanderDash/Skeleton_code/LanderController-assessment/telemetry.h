@@ -0,0 +1,92 @@
+/* Telemetry Schema
+ * KV5002
+ *
+ * Every telemetry field, listed once.  The structures, the lander message
+ * parsers and formatter, the dashboard and binary encoders, the history
+ * columns and the log writer are all expanded from these lists, so a
+ * field added here turns up everywhere it should.
+ *
+ *   FIELD(NAME, member, key, wire, type)
+ *     NAME    suffix of its subscription bit, F_NAME
+ *     member  its name in the structure
+ *     key     its name to dashboards and in the log
+ *     wire    its name in lander messages
+ *     type    FLOAT, PERCENT (a float the lander sends with a %) or CONTACT
+ */
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define CONDITION_FIELDS(FIELD)                          \
+    FIELD(FUEL, fuel, "fuel", "fuel", PERCENT)           \
+    FIELD(ALTITUDE, altitude, "altitude", "altitude", FLOAT) \
+    FIELD(CONTACT, contact, "contact", "contact", CONTACT)
+
+#define STATE_FIELDS(FIELD)           \
+    FIELD(X, x, "x", "x", FLOAT)      \
+    FIELD(Y, y, "y", "y", FLOAT)      \
+    FIELD(O, O, "O", "O", FLOAT)      \
+    FIELD(DX, dx, "x'", "x'", FLOAT)  \
+    FIELD(DY, dy, "y'", "y'", FLOAT)  \
+    FIELD(DO, dO, "O'", "O'", FLOAT)
+
+#define COMMAND_FIELDS(FIELD)                              \
+    FIELD(THRUST, thrust, "thrust", "main-engine", FLOAT)  \
+    FIELD(ROTN, rotn, "rotn", "rcs-roll", FLOAT)
+
+/* All of them, in subscription bit order */
+#define TELEMETRY_FIELDS(FIELD) \
+    CONDITION_FIELDS(FIELD)     \
+    STATE_FIELDS(FIELD)         \
+    COMMAND_FIELDS(FIELD)
+
+/* The C type of each field type */
+#define CTYPE_FLOAT float
+#define CTYPE_PERCENT float
+#define CTYPE_CONTACT int
+
+#define TELEMETRY_MEMBER(NAME, member, key, wire, type) CTYPE_##type member;
+
+/* Subscription bits, F_FUEL etc. */
+#define TELEMETRY_BIT(NAME, member, key, wire, type) B_##NAME,
+#define TELEMETRY_MASK(NAME, member, key, wire, type) F_##NAME = 1 << B_##NAME,
+enum fieldbit { TELEMETRY_FIELDS(TELEMETRY_BIT) NFIELDS };
+enum field { TELEMETRY_FIELDS(TELEMETRY_MASK) };
+#define F_ALL ((1 << NFIELDS) - 1)
+
+extern const char *fieldnames[NFIELDS];
+
+/* One sample of every field */
+struct telemetry
+{
+    TELEMETRY_FIELDS(TELEMETRY_MEMBER)
+};
+
+struct command;
+struct state;
+struct condition;
+
+/* Collects a sample from the lander's structures */
+void telemetry_gather(struct telemetry *t, const struct command *cmd,
+                      const struct state *st, const struct condition *cond);
+
+/* The fields in the mask as "key:value" lines, returns the length */
+size_t telemetry_format(char *buffer, size_t size, const struct telemetry *t,
+                        unsigned fields);
+
+/* The fields in the mask packed in schema order after the mask itself,
+   four bytes each in host byte order; returns the length, 0 if it won't fit */
+size_t telemetry_encode(void *buffer, size_t size, const struct telemetry *t,
+                        unsigned fields);
+
+/* Unpacks telemetry_encode(), returns the mask or 0 if it is malformed */
+unsigned telemetry_decode(const void *buffer, size_t size, struct telemetry *t);
+
+/* Writes one log record, mono the sample's CLOCK_MONOTONIC seconds,
+   returns false on failure */
+int telemetry_log(FILE *f, const char *time, double mono, const char *key,
+                  const struct telemetry *t);
+
+#endif
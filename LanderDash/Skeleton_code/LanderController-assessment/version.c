@@ -0,0 +1,62 @@
+/* Version Counters
+ * KV5002
+ */
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "version.h"
+
+static int futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+uint32_t version_read(struct version *v)
+{
+    return __atomic_load_n(&v->n, __ATOMIC_ACQUIRE);
+}
+
+void version_bump(struct version *v)
+{
+    /* the waiter counts itself before it checks the version, so one of us
+       sees the other */
+    __atomic_add_fetch(&v->n, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&v->waiters, __ATOMIC_SEQ_CST))
+        futex(&v->n, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+uint32_t version_wait(struct version *v, uint32_t seen, int64_t timeout)
+{
+    struct timespec end, now, left;
+    uint32_t n;
+    int64_t ns;
+
+    if (timeout >= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end.tv_sec += (end.tv_nsec + timeout) / 1000000000L;
+        end.tv_nsec = (end.tv_nsec + timeout) % 1000000000L;
+    }
+
+    while ((n = version_read(v)) == seen)
+    {
+        if (timeout >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ns = (int64_t)(end.tv_sec - now.tv_sec) * 1000000000L + (end.tv_nsec - now.tv_nsec);
+            if (ns <= 0)
+                break;
+            left.tv_sec = ns / 1000000000L;
+            left.tv_nsec = ns % 1000000000L;
+        }
+        __atomic_add_fetch(&v->waiters, 1, __ATOMIC_SEQ_CST);
+        futex(&v->n, FUTEX_WAIT_PRIVATE, seen, timeout < 0 ? NULL : &left);
+        __atomic_sub_fetch(&v->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return n;
+}
@@ -0,0 +1,34 @@
+/* Version Counters
+ * KV5002
+ *
+ * A counter that a producer bumps each time it has new data, and that
+ * consumers wait on until it has moved past the last version they saw,
+ * or until a timeout.  A consumer that has seen the current version
+ * has nothing new to show or send.
+ *
+ * Waiting is on a futex, and the producer makes the wake-up call only
+ * when someone is waiting.  A bump with nobody waiting costs one atomic
+ * add.
+ */
+#ifndef _VERSION_H
+#define _VERSION_H
+
+#include <stdint.h>
+
+struct version
+{
+    uint32_t n;       /* the futex word */
+    uint32_t waiters;
+};
+
+/* The current version */
+uint32_t version_read(struct version *v);
+
+/* Moves on to the next version and wakes every waiter */
+void version_bump(struct version *v);
+
+/* Waits up to timeout ns (-1 for ever) for the version to differ from
+   seen, returns the version: still seen if the time ran out */
+uint32_t version_wait(struct version *v, uint32_t seen, int64_t timeout);
+
+#endif